@@ -0,0 +1,333 @@
+/*
+ *  ssss-bench  -  Copyright held by respective contributors
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+ *  02111-1307 USA
+ */
+
+/*
+ * Microbenchmarks for the arithmetic kernels of ssss and for complete
+ * split and combine operations, run by "make bench".
+ *
+ * The results are printed as CSV with the columns
+ *
+ *   kernel,degree,t,n,iterations,ns_per_op,ops_per_s
+ *
+ * where t and n are 0 for kernels that don't depend on them. The set of
+ * rows and their order only change when kernels are added, so the output
+ * of different releases can be compared line by line.
+ *
+ * Usage: ssss-bench [-m min_ms] [-j threads] [-d degrees] [-p t:n,...]
+ */
+
+#define NOMAIN 1
+#include "ssss.c"
+
+static double bench_min_ns = 200e6;
+
+static const int bench_degrees[] = { 64, 128, 256, 512, 1024 };
+static const int bench_pairs[][2] = { { 3, 5 }, { 10, 20 }, { 32, 64 } };
+
+struct bench {
+  int t, n;
+  mpz_t *coeff, *y, *A, *A0, *b, *b0, *x, *s;
+  unsigned long *points;
+  struct ptree *tree;
+  char **shares;
+  char hex[MAXDEGREE / 4 + 1];
+  mpz_t u, v, w;
+  FILE *null;
+};
+
+double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* run op until at least bench_min_ns have passed, doubling the number of
+   iterations each time; print a CSV row */
+
+void bench_run(const char *kernel, int t, int n,
+               void (*op)(struct bench *), struct bench *B)
+{
+  unsigned long iters, i;
+  double start, ns;
+  for(iters = 1; ; iters *= 2) {
+    start = bench_now();
+    for(i = 0; i < iters; i++)
+      op(B);
+    ns = bench_now() - start;
+    if (ns >= bench_min_ns)
+      break;
+  }
+  printf("%s,%u,%d,%d,%lu,%.1f,%.1f\n", kernel, degree, t, n, iters,
+         ns / iters, iters * 1e9 / ns);
+  fflush(stdout);
+}
+
+void op_field_mult(struct bench *B)
+{
+  field_mult(B->w, B->u, B->v);
+}
+
+void op_field_invert(struct bench *B)
+{
+  field_invert(B->w, B->u);
+}
+
+void op_encode(struct bench *B)
+{
+  encode_mpz(B->w, ENCODE);
+}
+
+void op_decode(struct bench *B)
+{
+  encode_mpz(B->w, DECODE);
+}
+
+void op_field_import(struct bench *B)
+{
+  field_import(B->w, B->hex, 1);
+}
+
+void op_field_print(struct bench *B)
+{
+  field_print(B->null, B->u, 1);
+}
+
+void op_horner_r(struct bench *B)
+{
+  horner_r(B->t, B->w, B->u, (const mpz_t *)B->coeff);
+}
+
+void op_horner_r_points(struct bench *B)
+{
+  horner_r_points(B->y, B->points, B->n, B->t, (const mpz_t *)B->coeff);
+}
+
+void op_mpeval(struct bench *B)
+{
+  int i;
+  for(i = 0; i < B->t; i++)
+    mpz_set(B->s[i], B->coeff[B->t - 1 - i]);
+  mpz_set_ui(B->s[B->t], 1);
+  mpeval(B->y, B->tree, (const mpz_t *)B->s, B->t + 1);
+}
+
+void op_restore_secret(struct bench *B)
+{
+  size_t i;
+  for(i = 0; i < (size_t)B->t * B->t; i++)
+    mpz_set(B->A[i], B->A0[i]);
+  for(i = 0; i < (size_t)B->t; i++)
+    mpz_set(B->b[i], B->b0[i]);
+  restore_secret(B->t, (mpz_t (*)[B->t])B->A, B->b, 1);
+}
+
+void op_lagrange_secret(struct bench *B)
+{
+  lagrange_secret(B->t, (const mpz_t *)B->x, (const mpz_t *)B->b0, B->w);
+}
+
+/* what split() does, minus reading the secret from the terminal */
+
+void op_split(struct bench *B)
+{
+  int i;
+  field_import(B->coeff[B->t - 1], B->hex, 1);
+  encode_mpz(B->coeff[B->t - 1], ENCODE);
+  for(i = B->t - 2; i >= 0; i--)
+    cprng_read(B->coeff[i]);
+  horner_r_points(B->y, B->points, B->n, B->t, (const mpz_t *)B->coeff);
+  for(i = 0; i < B->n; i++) {
+    fprintf(B->null, "%d-", i + 1);
+    field_print(B->null, B->y[i], 1);
+  }
+}
+
+/* what combine_secret() does, minus reading the shares from the terminal */
+
+void op_combine(struct bench *B)
+{
+  int i;
+  for(i = 0; i < B->t; i++) {
+    mpz_set_ui(B->x[i], i + 1);
+    field_import(B->s[i], B->shares[i], 1);
+    field_pow_ui(B->w, B->x[i], B->t);
+    field_add(B->s[i], B->s[i], B->w);
+  }
+  lagrange_secret(B->t, (const mpz_t *)B->x, (const mpz_t *)B->s, B->w);
+  encode_mpz(B->w, DECODE);
+  field_print(B->null, B->w, 1);
+}
+
+void bench_field(struct bench *B)
+{
+  cprng_read(B->u);
+  cprng_read(B->v);
+  if (! mpz_cmp_ui(B->u, 0))
+    mpz_set_ui(B->u, 1);
+  mpz_set(B->w, B->u);
+  mpz_get_str(B->hex, 16, B->u);
+  bench_run("field_mult", 0, 0, op_field_mult, B);
+  bench_run("field_invert", 0, 0, op_field_invert, B);
+  bench_run("encode_mpz_encode", 0, 0, op_encode, B);
+  bench_run("encode_mpz_decode", 0, 0, op_decode, B);
+  bench_run("field_import", 0, 0, op_field_import, B);
+  bench_run("field_print", 0, 0, op_field_print, B);
+}
+
+void bench_scheme(struct bench *B, int t, int n)
+{
+  int i, j;
+  B->t = t;
+  B->n = n;
+  B->coeff = field_vec_xalloc(t);
+  B->y = field_vec_xalloc(n);
+  B->A = field_vec_xalloc((size_t)t * t);
+  B->A0 = field_vec_xalloc((size_t)t * t);
+  B->b = field_vec_xalloc(t);
+  B->b0 = field_vec_xalloc(t);
+  B->x = field_vec_xalloc(t);
+  B->s = field_vec_xalloc(t + 1);
+  if (! (B->points = malloc(n * sizeof(unsigned long))) ||
+      ! (B->shares = calloc(n, sizeof(char *))))
+    fatal_errcode(ssss_err_out_of_memory);
+  for(i = 0; i < t; i++)
+    cprng_read(B->coeff[i]);
+  for(i = 0; i < n; i++)
+    B->points[i] = i + 1;
+  horner_r_points(B->y, B->points, n, t, (const mpz_t *)B->coeff);
+  for(i = 0; i < n; i++)
+    B->shares[i] = mpz_get_str(NULL, 16, B->y[i]);
+  /* the equation system of combine(), see there */
+  for(i = 0; i < t; i++) {
+    mpz_set_ui(B->x[i], i + 1);
+    mpz_set_ui(B->A0[(size_t)(t - 1) * t + i], 1);
+    for(j = t - 2; j >= 0; j--)
+      field_mult(B->A0[(size_t)j * t + i], B->A0[(size_t)(j + 1) * t + i],
+                 B->x[i]);
+    field_mult(B->w, B->x[i], B->A0[i]);
+    field_add(B->b0[i], B->y[i], B->w);
+  }
+  if (! (B->tree = ptree_build(B->points, n)))
+    fatal_errcode(ssss_err_out_of_memory);
+
+  bench_run("horner_r", t, n, op_horner_r, B);
+  bench_run("horner_r_points", t, n, op_horner_r_points, B);
+  bench_run("mpeval", t, n, op_mpeval, B);
+  bench_run("restore_secret", t, n, op_restore_secret, B);
+  bench_run("lagrange_secret", t, n, op_lagrange_secret, B);
+  bench_run("split", t, n, op_split, B);
+  bench_run("combine", t, n, op_combine, B);
+
+  ptree_free(B->tree);
+  for(i = 0; i < n; i++)
+    free(B->shares[i]);
+  free(B->shares);
+  free(B->points);
+  field_vec_free(B->coeff, t);
+  field_vec_free(B->y, n);
+  field_vec_free(B->A, (size_t)t * t);
+  field_vec_free(B->A0, (size_t)t * t);
+  field_vec_free(B->b, t);
+  field_vec_free(B->b0, t);
+  field_vec_free(B->x, t);
+  field_vec_free(B->s, t + 1);
+}
+
+/* parse a comma separated list of integers or t:n pairs */
+
+int bench_parse(const char *s, int *v, int max, int pairs)
+{
+  int k = 0;
+  char *end;
+  while (*s && k < max) {
+    v[k++] = strtol(s, &end, 10);
+    if (pairs) {
+      if (*end != ':')
+        return -1;
+      v[k++] = strtol(end + 1, &end, 10);
+    }
+    if (*end && *end != ',')
+      return -1;
+    s = *end ? end + 1 : end;
+  }
+  return k;
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench B;
+  int degrees[32], pairs[64], ndegrees, npairs, d, p, i;
+  enum ssss_errcode ec;
+
+  ndegrees = sizeof(bench_degrees) / sizeof(bench_degrees[0]);
+  memcpy(degrees, bench_degrees, sizeof(bench_degrees));
+  npairs = 2 * sizeof(bench_pairs) / sizeof(bench_pairs[0]);
+  memcpy(pairs, bench_pairs, sizeof(bench_pairs));
+  opt_threads = 1;
+  opt_QUIET = opt_quiet = 1;
+
+  while((i = getopt(argc, argv, "m:j:d:p:")) != -1)
+    switch(i) {
+    case 'm': bench_min_ns = atof(optarg) * 1e6; break;
+    case 'j': opt_threads = atoi(optarg); break;
+    case 'd':
+      if ((ndegrees = bench_parse(optarg, degrees, 32, 0)) <= 0)
+        fatal("invalid list of degrees");
+      break;
+    case 'p':
+      if ((npairs = bench_parse(optarg, pairs, 64, 1)) <= 0)
+        fatal("invalid list of t:n pairs");
+      break;
+    default:
+      exit(1);
+    }
+  for(d = 0; d < ndegrees; d++)
+    if (! field_size_valid(degrees[d]) || degrees[d] < 64)
+      fatal("degrees have to be multiples of 8 from 64 to 1024");
+  for(p = 0; p < npairs; p += 2)
+    if (pairs[p] < 2 || pairs[p + 1] < pairs[p] || pairs[p + 1] > MAXSHARES)
+      fatal("invalid t:n pair");
+
+  if ((ec = cprng_init()) != ssss_ec_ok)
+    fatal_errcode(ec);
+  if (! (B.null = fopen("/dev/null", "w")))
+    fatal("couldn't open /dev/null");
+  mpz_init(B.u);
+  mpz_init(B.v);
+  mpz_init(B.w);
+  pool_init(opt_threads);
+
+  printf("kernel,degree,t,n,iterations,ns_per_op,ops_per_s\n");
+  for(d = 0; d < ndegrees; d++) {
+    field_init(degrees[d]);
+    bench_field(&B);
+    for(p = 0; p < npairs; p += 2)
+      bench_scheme(&B, pairs[p], pairs[p + 1]);
+    field_deinit();
+  }
+
+  pool_deinit();
+  mpz_clear(B.u);
+  mpz_clear(B.v);
+  mpz_clear(B.w);
+  fclose(B.null);
+  cprng_deinit();
+  return 0;
+}
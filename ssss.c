@@ -34,6 +34,11 @@
  *
  * Compile with -DNOMLOCK to obtain a version without memory locking.
  *
+ * Compile with -DNOSTATS to obtain a version without --stats.
+ *
+ * Compile with -DNOMAIN to include this file into another program, like
+ * the benchmark ssss-bench.c.
+ *
  * If you encounter compile issues, compile with USE_RESTORE_SECRET_WORKAROUND.
  *
  * Report bugs to: ssss AT point-at-infinity.org
@@ -48,9 +53,15 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <math.h>
 #include <assert.h>
 #include <termios.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <getopt.h>
 
 #include <gmp.h>
 
@@ -58,6 +69,8 @@
 #define RANDOM_SOURCE "/dev/urandom"
 #define MAXDEGREE 1024
 #define MAXTOKENLEN 128
+#define MAXSHARES 65535
+#define MAXTHREADS 256
 #define MAXLINELEN (MAXTOKENLEN + 1 + 10 + 1 + MAXDEGREE / 4 + 10)
 
 /* coefficients of some irreducible polynomials over GF(2) */
@@ -86,6 +99,15 @@ int opt_threshold = -1;
 int opt_number = -1;
 char *opt_token = NULL;
 int opt_recovery = 0;
+int opt_threads = 0;
+int opt_stats = 0;
+int opt_packed = 1;
+int opt_refresh = 0;
+int opt_batch = 0;
+int opt_audit = 0;
+int opt_selftest = 0;
+unsigned long *opt_index = NULL;
+int opt_nindex = 0;
 
 unsigned int degree = 0;
 mpz_t poly;
@@ -106,6 +128,11 @@ enum ssss_errcode {
   ssss_err_shares_different_security_levels,
   ssss_err_invalid_share,
   ssss_err_inconsistent_shares,
+  ssss_err_too_many_shares,
+  ssss_err_out_of_memory,
+  ssss_err_threads,
+  ssss_err_audit_failed,
+  ssss_err_selftest_failed,
   ssss_err_unknown
 };
 
@@ -123,6 +150,11 @@ static const char *ssss_errmsg[] = {
   "shares have different security levels",
   "invalid share",
   "shares inconsistent. Perhaps a single share was used twice",
+  "security level too small for this number of shares",
+  "out of memory",
+  "couldn't start threads",
+  "audit found bad shares",
+  "self-test failed",
   "unknown error"
 };
 
@@ -151,6 +183,125 @@ void warning(char *msg)
     fprintf(stderr, "%sWARNING: %s.\n", isatty(2) ? "\a" : "", msg);
 }
 
+/* instrumentation for --stats: wall and CPU time per phase, and counters
+   for the expensive operations. The counters are kept per thread and
+   summed up when a thread finishes a piece of work. Compile with
+   -DNOSTATS to remove all of it. */
+
+#if ! NOSTATS
+
+enum stats_phase {
+  STATS_OTHER = 0,
+  STATS_ENTROPY,
+  STATS_INPUT,
+  STATS_DIFFUSION,
+  STATS_EVALUATION,
+  STATS_INTERPOLATION,
+  STATS_OUTPUT,
+  STATS_NPHASES
+};
+
+static const char *stats_phase_name[] = {
+  "other",
+  "entropy",
+  "input",
+  "diffusion",
+  "evaluation",
+  "interpolation",
+  "output"
+};
+
+struct stats_counters {
+  unsigned long long mults, inversions, allocs, bytes;
+};
+
+struct {
+  pthread_mutex_t lock;
+  struct stats_counters total;
+  enum stats_phase phase;
+  struct timespec wall_mark, cpu_mark;
+  double wall[STATS_NPHASES], cpu[STATS_NPHASES];
+} stats = { PTHREAD_MUTEX_INITIALIZER, { 0, 0, 0, 0 }, STATS_OTHER,
+            { 0, 0 }, { 0, 0 }, { 0 }, { 0 } };
+
+_Thread_local struct stats_counters stats_local;
+
+#define STATS_COUNT(c) (stats_local.c++)
+#define STATS_ADD(c, n) (stats_local.c += (n))
+#define STATS_PHASE(p) stats_phase(p)
+#define STATS_FLUSH() stats_flush()
+
+double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+  return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/* charge the time since the last call to the current phase and enter
+   phase p. Only called by the main thread. */
+
+void stats_phase(enum stats_phase p)
+{
+  struct timespec wall, cpu;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  if (stats.wall_mark.tv_sec || stats.wall_mark.tv_nsec) {
+    stats.wall[stats.phase] += timespec_diff(&wall, &stats.wall_mark);
+    stats.cpu[stats.phase] += timespec_diff(&cpu, &stats.cpu_mark);
+  }
+  stats.wall_mark = wall;
+  stats.cpu_mark = cpu;
+  stats.phase = p;
+}
+
+void stats_flush(void)
+{
+  pthread_mutex_lock(&stats.lock);
+  stats.total.mults += stats_local.mults;
+  stats.total.inversions += stats_local.inversions;
+  stats.total.allocs += stats_local.allocs;
+  stats.total.bytes += stats_local.bytes;
+  pthread_mutex_unlock(&stats.lock);
+  memset(&stats_local, 0, sizeof(stats_local));
+}
+
+void stats_report(FILE *stream, int json)
+{
+  int p;
+  stats_phase(STATS_OTHER);
+  stats_flush();
+  if (json) {
+    fprintf(stream, "{\"phases\": {");
+    for(p = 0; p < STATS_NPHASES; p++)
+      fprintf(stream, "%s\"%s\": {\"wall\": %.9f, \"cpu\": %.9f}",
+              p ? ", " : "", stats_phase_name[p], stats.wall[p], stats.cpu[p]);
+    fprintf(stream, "}, \"field_mults\": %llu, \"field_inversions\": %llu, "
+            "\"allocations\": %llu, \"bytes_written\": %llu}\n",
+            stats.total.mults, stats.total.inversions, stats.total.allocs,
+            stats.total.bytes);
+  }
+  else {
+    fprintf(stream, "%-16s %12s %12s\n", "phase", "wall [s]", "cpu [s]");
+    for(p = 0; p < STATS_NPHASES; p++)
+      fprintf(stream, "%-16s %12.6f %12.6f\n", stats_phase_name[p],
+              stats.wall[p], stats.cpu[p]);
+    fprintf(stream, "field multiplications: %llu\n"
+            "field inversions: %llu\n"
+            "allocations: %llu\n"
+            "bytes written: %llu\n",
+            stats.total.mults, stats.total.inversions, stats.total.allocs,
+            stats.total.bytes);
+  }
+}
+
+#else
+
+#define STATS_COUNT(c) ((void)0)
+#define STATS_ADD(c, n) ((void)(n))
+#define STATS_PHASE(p) ((void)0)
+#define STATS_FLUSH() ((void)0)
+
+#endif
+
 /* field arithmetic routines */
 
 int field_size_valid(int deg)
@@ -181,8 +332,58 @@ void field_deinit(void)
   degree = 0;
 }
 
+/* share indices are field elements, so they have to be nonzero and fit
+   into the field */
+
+int field_index_valid(unsigned long j)
+{
+  return j && j <= MAXSHARES && (degree > 16 || ! (j >> degree));
+}
+
+/* wipe a field element, leaving it initialized (to zero) */
+
+void field_wipe(mpz_t x)
+{
+  mpz_clear(x);
+  mpz_init(x);
+}
+
+/* heap allocated vectors of field elements. Threshold and number of shares
+   may be as large as MAXSHARES, which is far too much for the stack. */
+
+mpz_t *field_vec_alloc(size_t n)
+{
+  mpz_t *v;
+  size_t i;
+  if (n > SIZE_MAX / sizeof(mpz_t) || ! (v = malloc(n * sizeof(mpz_t))))
+    return NULL;
+  for(i = 0; i < n; i++)
+    mpz_init(v[i]);
+  return v;
+}
+
+void field_vec_free(mpz_t *v, size_t n)
+{
+  size_t i;
+  if (v) {
+    for(i = 0; i < n; i++)
+      mpz_clear(v[i]);
+    free(v);
+  }
+}
+
+/* allocation failures in the middle of a computation are fatal */
+
+mpz_t *field_vec_xalloc(size_t n)
+{
+  mpz_t *v = field_vec_alloc(n);
+  if (! v)
+    fatal_errcode(ssss_err_out_of_memory);
+  return v;
+}
+
 /* I/O routines for GF(2^deg) field elements */
-/* clears x on error */
+/* wipes x on error */
 
 enum ssss_errcode field_import(mpz_t x, const char *s, int hexmode)
 {
@@ -209,7 +410,7 @@ enum ssss_errcode field_import(mpz_t x, const char *s, int hexmode)
     }
   }
   if (ec != ssss_ec_ok)
-    mpz_clear(x);
+    field_wipe(x);
   return ec;
 }
 
@@ -221,6 +422,7 @@ void field_print(FILE* stream, const mpz_t x, int hexmode)
       fprintf(stream, "0");
     mpz_out_str(stream, 16, x);
     fprintf(stream, "\n");
+    STATS_ADD(bytes, degree / 4 + 1);
   }
   else {
     char buf[MAXDEGREE / 8 + 1];
@@ -235,6 +437,7 @@ void field_print(FILE* stream, const mpz_t x, int hexmode)
       fprintf(stream, "%c", printable ? buf[i] : '.');
     }
     fprintf(stream, "\n");
+    STATS_ADD(bytes, t + 1);
     if (warn)
       warning("binary data detected, use -x mode instead");
     secure_zero(buf, sizeof(buf));
@@ -255,6 +458,7 @@ void field_mult(mpz_t z, const mpz_t x, const mpz_t y)
   mpz_t b;
   unsigned int i;
   assert(z != y);
+  STATS_COUNT(mults);
   mpz_init_set(b, x);
   if (mpz_tstbit(y, 0))
     mpz_set(z, b);
@@ -275,6 +479,7 @@ void field_invert(mpz_t z, const mpz_t x)
   mpz_t u, v, g, h;
   int i;
   assert(mpz_cmp_ui(x, 0));
+  STATS_COUNT(inversions);
   mpz_init_set(u, x);
   mpz_init_set(v, poly);
   mpz_init_set_ui(g, 0);
@@ -295,6 +500,27 @@ void field_invert(mpz_t z, const mpz_t x)
   mpz_clear(u); mpz_clear(v); mpz_clear(g); mpz_clear(h);
 }
 
+/* square and multiply */
+
+void field_pow_ui(mpz_t z, const mpz_t x, unsigned long e)
+{
+  mpz_t b, h;
+  mpz_init_set(b, x);
+  mpz_init(h);
+  mpz_set_ui(z, 1);
+  for(; e; e >>= 1) {
+    if (e & 1) {
+      field_mult(h, z, b);
+      mpz_swap(z, h);
+    }
+    if (e > 1) {
+      field_mult(h, b, b);
+      mpz_swap(b, h);
+    }
+  }
+  mpz_clear(b); mpz_clear(h);
+}
+
 /* routines for the random number generator */
 
 enum ssss_errcode cprng_init(void)
@@ -426,10 +652,202 @@ void horner_r(int n, mpz_t y, const mpz_t x, const mpz_t coeff_rev[])
   field_add(y, y, coeff_rev[i]);
 }
 
+/* a small thread pool running the iterations of a loop in parallel. The
+   calling thread takes part in the work, so a pool of one thread has no
+   worker threads at all and pool_for() degenerates to a plain call. */
+
+#define POOL_STACK_SIZE (256 * 1024)
+
+struct {
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  pthread_t *threads;
+  int nthreads;
+  unsigned long generation;
+  int shutdown;
+  void (*fn)(void *arg, int lo, int hi);
+  void *arg;
+  int next, end, grain, busy;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, NULL, NULL, 0, 0, 0, 0 };
+
+/* set while a thread runs a pool task; nested loops run sequentially */
+_Thread_local int pool_task = 0;
+
+/* hand out chunks of the current loop until it is exhausted; called and
+   returns with pool.lock held */
+
+void pool_drain(void)
+{
+  int lo, hi;
+  while (pool.next < pool.end) {
+    lo = pool.next;
+    hi = pool.end - lo > pool.grain ? lo + pool.grain : pool.end;
+    pool.next = hi;
+    pool.busy++;
+    pthread_mutex_unlock(&pool.lock);
+    pool_task = 1;
+    pool.fn(pool.arg, lo, hi);
+    pool_task = 0;
+    STATS_FLUSH();
+    pthread_mutex_lock(&pool.lock);
+    if (! --pool.busy && pool.next >= pool.end)
+      pthread_cond_broadcast(&pool.done);
+  }
+}
+
+void *pool_worker(void *unused)
+{
+  unsigned long seen = 0;
+  (void)unused;
+  pthread_mutex_lock(&pool.lock);
+  for(;;) {
+    while (! pool.shutdown && pool.generation == seen)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    if (pool.shutdown)
+      break;
+    seen = pool.generation;
+    pool_drain();
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+/* the default number of threads: one per online CPU, up to MAXTHREADS */
+
+int pool_default_threads(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n > MAXTHREADS ? MAXTHREADS : n;
+}
+
+/* start nthreads - 1 worker threads (nthreads <= 0: the default) */
+
+void pool_init(int nthreads)
+{
+  pthread_attr_t attr;
+  int i;
+  if (nthreads <= 0)
+    nthreads = pool_default_threads();
+  if (nthreads <= 1 || ! (pool.threads = malloc((nthreads - 1) *
+                                                sizeof(pthread_t))))
+    return;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+  for(i = 0; i < nthreads - 1; i++)
+    if (pthread_create(&pool.threads[i], &attr, pool_worker, NULL)) {
+      warning("couldn't start all worker threads");
+      break;
+    }
+  pool.nthreads = i;
+  pthread_attr_destroy(&attr);
+}
+
+void pool_deinit(void)
+{
+  int i;
+  pthread_mutex_lock(&pool.lock);
+  pool.shutdown = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_mutex_unlock(&pool.lock);
+  for(i = 0; i < pool.nthreads; i++)
+    pthread_join(pool.threads[i], NULL);
+  free(pool.threads);
+  pool.threads = NULL;
+  pool.nthreads = 0;
+}
+
+/* call fn(arg, lo', hi') for consecutive subranges of [lo, hi) of at
+   most grain iterations each, in parallel, and wait for all of them */
+
+void pool_for(int lo, int hi, int grain,
+              void (*fn)(void *arg, int lo, int hi), void *arg)
+{
+  if (grain < 1)
+    grain = 1;
+  if (! pool.nthreads || hi - lo <= grain || pool_task) {
+    if (lo < hi)
+      fn(arg, lo, hi);
+    return;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.next = lo;
+  pool.end = hi;
+  pool.grain = grain;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.work);
+  pool_drain();
+  while (pool.busy || pool.next < pool.end)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+/* split n iterations into about four chunks per thread, but never into
+   chunks smaller than min */
+
+int pool_grain(int n, int min)
+{
+  int grain = n / (4 * (pool.nthreads + 1));
+  return grain > min ? grain : min;
+}
+
 /* calculate the secret from a set of shares solving a linear equation system */
 
-#define MPZ_SWAP(A, B) \
-  do { mpz_set(h, A); mpz_set(A, B); mpz_set(B, h); } while(0)
+/* AA[k][j] of restore_secret(), with the n x n matrix passed as a flat
+   array to the worker threads */
+#define ELIM(c, k, j) ((c)->AA[(size_t)(k) * (c)->n + (j)])
+
+/* rows with fewer than this many entries left are not worth a thread */
+#define ELIM_MIN_GRAIN 8
+
+struct elim_ctx {
+  int n, i;
+  mpz_t *AA;
+  mpz_t *b;
+};
+
+/* eliminate the i-th unknown from rows [lo, hi). The rows are independent
+   of each other. The row block is swept one column at a time, so that the
+   AA[k][lo..hi) touched in the innermost loop are adjacent in memory. */
+
+void elim_rows(void *arg, int lo, int hi)
+{
+  struct elim_ctx *c = arg;
+  int i = c->i, j, k;
+  mpz_t h;
+  mpz_init(h);
+  for(k = i + 1; k < c->n; k++)
+    for(j = lo; j < hi; j++)
+      if (mpz_cmp_ui(ELIM(c, i, j), 0)) {
+        field_mult(h, ELIM(c, k, i), ELIM(c, i, j));
+        field_mult(ELIM(c, k, j), ELIM(c, k, j), ELIM(c, i, i));
+        field_add(ELIM(c, k, j), ELIM(c, k, j), h);
+      }
+  for(j = lo; j < hi; j++)
+    if (mpz_cmp_ui(ELIM(c, i, j), 0)) {
+      field_mult(h, c->b[i], ELIM(c, i, j));
+      field_mult(c->b[j], c->b[j], ELIM(c, i, i));
+      field_add(c->b[j], c->b[j], h);
+    }
+  mpz_clear(h);
+}
+
+/* substitute the (final) i-th coefficient into rows [lo, hi) */
+
+void backsub_rows(void *arg, int lo, int hi)
+{
+  struct elim_ctx *c = arg;
+  int i = c->i, j;
+  mpz_t h;
+  mpz_init(h);
+  for(j = lo; j < hi; j++) {
+    field_mult(h, c->b[i], ELIM(c, i, j));
+    field_add(c->b[j], c->b[j], h);
+  }
+  mpz_clear(h);
+}
 
 int restore_secret(int n,
 #ifdef USE_RESTORE_SECRET_WORKAROUND
@@ -440,13 +858,14 @@ int restore_secret(int n,
                    mpz_t b[], int recovery)
 {
   mpz_t (*AA)[n] = (mpz_t (*)[n])A;
+  struct elim_ctx c = { n, 0, (mpz_t *)A, b };
   int i, j, k, found;
   mpz_t h;
-  mpz_init(h);
   /* Gaussian elimination. To imagine transformation into an upper triangular
    * matrix, treat AA[i][j] as AA[column][row] (perhaps this is because
    * Fortran matrix storage layout was reinterpreted as C storage layout).
-   * Remember the field_add and field_sub sameness in this field arithmetic. */
+   * Remember the field_add and field_sub sameness in this field arithmetic.
+   * The row updates of each step are independent and run in parallel. */
   for(i = 0; i < n; i++) {
     if (! mpz_cmp_ui(AA[i][i], 0)) {
       for(found = 0, j = i + 1; j < n; j++)
@@ -457,178 +876,790 @@ int restore_secret(int n,
       if (! found)
         return -1;
       for(k = i; k < n; k++)
-        MPZ_SWAP(AA[k][i], AA[k][j]);
-      MPZ_SWAP(b[i], b[j]);
-    }
-    for(j = i + 1; j < n; j++) {
-      if (mpz_cmp_ui(AA[i][j], 0)) {
-        for(k = i + 1; k < n; k++) {
-          field_mult(h, AA[k][i], AA[i][j]);
-          field_mult(AA[k][j], AA[k][j], AA[i][i]);
-          field_add(AA[k][j], AA[k][j], h);
-        }
-        field_mult(h, b[i], AA[i][j]);
-        field_mult(b[j], b[j], AA[i][i]);
-        field_add(b[j], b[j], h);
-      }
+        mpz_swap(AA[k][i], AA[k][j]);
+      mpz_swap(b[i], b[j]);
     }
+    c.i = i;
+    pool_for(i + 1, n, pool_grain(n - i - 1, ELIM_MIN_GRAIN), elim_rows, &c);
   }
   /* The matrix is in upper triangular form now.
    * Calculate the last coefficient (the secret). */
+  mpz_init(h);
   field_invert(h, AA[n - 1][n - 1]);
   field_mult(b[n - 1], b[n - 1], h);
   if (recovery) {
     /* Transform AA to identity matrix and calculate other coefficients
-     * to recover other shares. */
-    for(i = n - 2; i >= 0; i--) {
-      for(j = n - 1; j > i; j--) {
-        field_mult(h, b[j], AA[j][i]);
-        field_add(b[i], b[i], h);
-      }
-      field_invert(h, AA[i][i]);
-      field_mult(b[i], b[i], h);
+     * to recover other shares. Each coefficient is substituted into all
+     * rows above as soon as it is known, again in parallel. */
+    for(i = n - 1; i > 0; i--) {
+      c.i = i;
+      pool_for(0, i, pool_grain(i, ELIM_MIN_GRAIN), backsub_rows, &c);
+      field_invert(h, AA[i - 1][i - 1]);
+      field_mult(b[i - 1], b[i - 1], h);
     }
   }
   mpz_clear(h);
   return 0;
 }
 
-/* ask for a secret */
-/* clears secret on error */
+/* calculate the secret from a set of shares by Lagrange interpolation at
+ * x = 0. Other than restore_secret() this needs only O(n) memory and O(n^2)
+ * field multiplications, but it doesn't recover the other coefficients. */
 
-enum ssss_errcode ask_secret(mpz_t secret)
+int lagrange_secret(int n, const mpz_t x[], const mpz_t y[], mpz_t secret)
 {
-  enum ssss_errcode ec = ssss_ec_ok;
-  char buf[MAXLINELEN];
-  int deg;
-  if (! opt_quiet) {
-    deg = opt_security ? opt_security : MAXDEGREE;
-    fprintf(stderr, "Enter the secret, ");
-    if (opt_hex)
-      fprintf(stderr, "as most %d hex digits: ", deg / 4);
-    else
-      fprintf(stderr, "at most %d ASCII characters: ", deg / 8);
+  mpz_t num, den, h;
+  int i, j, ret = 0;
+  mpz_init_set_ui(num, 1);
+  mpz_init(den);
+  mpz_init(h);
+  mpz_set_ui(secret, 0);
+  /* secret = prod_j x_j * sum_i y_i / (x_i * prod_{j != i} (x_i - x_j)) */
+  for(i = 0; i < n && ! ret; i++) {
+    if (! mpz_cmp_ui(x[i], 0)) {
+      ret = -1;
+      break;
+    }
+    mpz_set(den, x[i]);
+    for(j = 0; j < n; j++)
+      if (j != i) {
+        field_add(h, x[i], x[j]);
+        if (! mpz_cmp_ui(h, 0)) {
+          ret = -1;
+          break;
+        }
+        field_mult(den, den, h);
+      }
+    if (! ret) {
+      field_invert(h, den);
+      field_mult(den, h, y[i]);
+      field_add(secret, secret, den);
+      field_mult(num, num, x[i]);
+    }
   }
-  tcsetattr(0, TCSANOW, &echo_off);
-  if (! fgets(buf, sizeof(buf), stdin))
-    ec = ssss_err_io_reading_secret;
-  if (ec == ssss_ec_ok) {
-    tcsetattr(0, TCSANOW, &echo_orig);
-    fprintf(stderr, "\n");
-    buf[strcspn(buf, "\r\n")] = '\0';
+  if (! ret)
+    field_mult(secret, secret, num);
+  mpz_clear(num); mpz_clear(den); mpz_clear(h);
+  return ret;
+}
 
-    if (! opt_security) {
-      opt_security = opt_hex ? 4 * ((strlen(buf) + 1) & ~1): 8 * strlen(buf);
-      if (! field_size_valid(opt_security))
-        ec = ssss_err_invalid_security_level;
-      if (ec == ssss_ec_ok) {
-        if (! opt_quiet)
-          fprintf(stderr, "Using a %d bit security level.\n", opt_security);
+/* evaluate the polynomial of degree < n through the points (x[i], y[i]) at
+ * the k points z[] by barycentric Lagrange interpolation. That is O(n^2 + k n)
+ * multiplications and n + k inversions, the 1 / (z - x[i]) being inverted
+ * all at once from their running products. */
+
+int lagrange_points(int n, const mpz_t x[], const mpz_t y[],
+                    int k, const mpz_t z[], mpz_t out[])
+{
+  mpz_t *v, *d, *p, h, g;
+  int i, j, l, ret = 0;
+  v = field_vec_xalloc(n);
+  d = field_vec_xalloc(n);
+  p = field_vec_xalloc(n);
+  mpz_init(h);
+  mpz_init(g);
+  /* v[i] = y[i] / prod_{j != i} (x[i] - x[j]) */
+  for(i = 0; i < n && ! ret; i++) {
+    mpz_set_ui(g, 1);
+    for(j = 0; j < n; j++)
+      if (j != i) {
+        field_add(h, x[i], x[j]);
+        if (! mpz_cmp_ui(h, 0)) {
+          ret = -1;
+          break;
+        }
+        field_mult(g, g, h);
+      }
+    if (! ret) {
+      field_invert(h, g);
+      field_mult(v[i], h, y[i]);
+    }
+  }
+  /* out = prod_i (z - x[i]) * sum_i v[i] / (z - x[i]) */
+  for(l = 0; l < k && ! ret; l++) {
+    for(j = -1, i = 0; i < n; i++) {
+      field_add(d[i], z[l], x[i]);
+      if (! mpz_cmp_ui(d[i], 0))
+        j = i;
+      if (i)
+        field_mult(p[i], p[i - 1], d[i]);
+      else
+        mpz_set(p[i], d[i]);
+    }
+    if (j >= 0) {
+      mpz_set(out[l], y[j]);
+      continue;
+    }
+    field_invert(g, p[n - 1]);
+    mpz_set_ui(out[l], 0);
+    for(i = n - 1; i >= 0; i--) {
+      if (i) {
+        field_mult(h, g, p[i - 1]);
+        field_mult(g, g, d[i]);
       }
+      else
+        mpz_set(h, g);
+      field_mult(h, h, v[i]);
+      field_add(out[l], out[l], h);
     }
+    field_mult(out[l], out[l], p[n - 1]);
   }
+  mpz_clear(h);
+  mpz_clear(g);
+  field_vec_free(v, n);
+  field_vec_free(d, n);
+  field_vec_free(p, n);
+  return ret;
+}
 
-  if (ec == ssss_ec_ok) {
-    field_init(opt_security);
-    ec = field_import(secret, buf, opt_hex);
-  } else
-    mpz_clear(secret);
+/* C[l * n + i] = L_i(z[l]) for the Lagrange basis polynomials L_i of the
+   points x[0 .. n), the weights with which the values at the x give the
+   value at z[l]. Returns -1 if two x are equal. */
 
-  if (ec == ssss_ec_ok)
-    if (opt_diffusion) {
-      if (degree >= 64)
-        encode_mpz(secret, ENCODE);
+int lagrange_basis(int n, const mpz_t x[], int k, const mpz_t z[], mpz_t C[])
+{
+  mpz_t *w, *d, *p, h, g;
+  int i, j, l, ret = 0;
+  w = field_vec_xalloc(n);
+  d = field_vec_xalloc(n);
+  p = field_vec_xalloc(n);
+  mpz_init(h);
+  mpz_init(g);
+  /* w[i] = 1 / prod_{j != i} (x[i] - x[j]) */
+  for(i = 0; i < n && ! ret; i++) {
+    mpz_set_ui(g, 1);
+    for(j = 0; j < n; j++)
+      if (j != i) {
+        field_add(h, x[i], x[j]);
+        if (! mpz_cmp_ui(h, 0)) {
+          ret = -1;
+          break;
+        }
+        field_mult(g, g, h);
+      }
+    if (! ret)
+      field_invert(w[i], g);
+  }
+  /* L_i(z) = w[i] * prod_{j != i} (z - x[j]), from prefix and suffix
+     products; no inversions needed */
+  for(l = 0; l < k && ! ret; l++) {
+    for(i = 0; i < n; i++) {
+      field_add(d[i], z[l], x[i]);
+      if (i)
+        field_mult(p[i], p[i - 1], d[i]);
       else
-        warning("security level too small for the diffusion layer");
+        mpz_set(p[i], d[i]);
     }
-
-  secure_zero(buf, sizeof(buf));
-  return ec;
+    mpz_set_ui(g, 1);
+    for(i = n - 1; i >= 0; i--) {
+      if (i)
+        field_mult(h, g, p[i - 1]);
+      else
+        mpz_set(h, g);
+      field_mult(C[(size_t)l * n + i], h, w[i]);
+      field_mult(g, g, d[i]);
+    }
+  }
+  mpz_clear(h);
+  mpz_clear(g);
+  field_vec_free(w, n);
+  field_vec_free(d, n);
+  field_vec_free(p, n);
+  return ret;
 }
 
-void calculate_shares_r(const mpz_t coeff_rev[]);
+/* polynomial arithmetic over GF(2^deg). Polynomials are vectors of field
+ * elements, lowest coefficient first. */
 
-/* Prompt for a secret, generate shares for it */
+/* multiplication with fewer coefficients than this is done classically */
+#define KARATSUBA_CUTOFF 16
 
-enum ssss_errcode split(void)
+/* r[0 .. na + nb - 1) = a * b, classical algorithm */
+
+void poly_mul_classic(mpz_t *r, const mpz_t *a, int na, const mpz_t *b, int nb)
 {
-  enum ssss_errcode ec = ssss_ec_ok;
-  mpz_t coeff[opt_threshold];
-  int i;
-  if (! opt_quiet) {
-    fprintf(stderr, "Generating shares using a (%d,%d) scheme with ",
-            opt_threshold, opt_number);
-    if (opt_security)
-      fprintf(stderr, "a %d bit", opt_security);
-    else
-      fprintf(stderr, "dynamic");
-    fprintf(stderr, " security level.\n");
-  }
-  i = opt_threshold - 1;
-  mpz_init(coeff[i]);
-  ec = ask_secret(coeff[i]);
-  i--;
+  mpz_t h;
+  int i, j;
+  mpz_init(h);
+  for(i = 0; i < na + nb - 1; i++)
+    mpz_set_ui(r[i], 0);
+  for(i = 0; i < na; i++)
+    for(j = 0; j < nb; j++) {
+      field_mult(h, a[i], b[j]);
+      field_add(r[i + j], r[i + j], h);
+    }
+  mpz_clear(h);
+}
 
-  if (ec == ssss_ec_ok)
-    ec = cprng_init();
-  for(; i >= 0 && ec == ssss_ec_ok; i--) {
-    mpz_init(coeff[i]);
-    ec = cprng_read(coeff[i]);
+/* r[0 .. 2n - 1) = a * b, Karatsuba's algorithm for two n-coefficient
+ * polynomials. Additions and subtractions are the same in this field. */
+
+void poly_mul_karatsuba(mpz_t *r, const mpz_t *a, const mpz_t *b, int n)
+{
+  mpz_t *s, *z;
+  int m, h, i;
+  if (n < KARATSUBA_CUTOFF) {
+    poly_mul_classic(r, a, n, b, n);
+    return;
   }
-  if (ec == ssss_ec_ok)
-    ec = cprng_deinit();
+  m = (n + 1) / 2;
+  h = n - m;
+  s = field_vec_xalloc(2 * m);
+  z = field_vec_xalloc(2 * m - 1);
+  for(i = 0; i < m; i++) {
+    mpz_set(s[i], a[i]);
+    mpz_set(s[m + i], b[i]);
+  }
+  for(i = 0; i < h; i++) {
+    field_add(s[i], s[i], a[m + i]);
+    field_add(s[m + i], s[m + i], b[m + i]);
+  }
+  poly_mul_karatsuba(z, s, s + m, m);
+  poly_mul_karatsuba(r, a, b, m);
+  mpz_set_ui(r[2 * m - 1], 0);
+  poly_mul_karatsuba(r + 2 * m, a + m, b + m, h);
+  for(i = 0; i < 2 * m - 1; i++)
+    field_add(z[i], z[i], r[i]);
+  for(i = 0; i < 2 * h - 1; i++)
+    field_add(z[i], z[i], r[2 * m + i]);
+  for(i = 0; i < 2 * m - 1; i++)
+    field_add(r[m + i], r[m + i], z[i]);
+  field_vec_free(s, 2 * m);
+  field_vec_free(z, 2 * m - 1);
+}
 
-  if (ec == ssss_ec_ok)
-    calculate_shares_r(coeff);
+/* r[0 .. na + nb - 1) = a * b; the longer operand is cut into pieces as
+ * long as the shorter one */
 
-  for(i = i + 1; i < opt_threshold; i++)
-    mpz_clear(coeff[i]);
-  field_deinit();
-  return ec;
+void poly_mul(mpz_t *r, const mpz_t *a, int na, const mpz_t *b, int nb)
+{
+  const mpz_t *c;
+  mpz_t *z;
+  int off, len, i;
+  if (na < nb) {
+    c = a; a = b; b = c;
+    i = na; na = nb; nb = i;
+  }
+  if (nb < KARATSUBA_CUTOFF) {
+    poly_mul_classic(r, a, na, b, nb);
+    return;
+  }
+  if (na == nb) {
+    poly_mul_karatsuba(r, a, b, nb);
+    return;
+  }
+  z = field_vec_xalloc(2 * nb - 1);
+  for(i = 0; i < na + nb - 1; i++)
+    mpz_set_ui(r[i], 0);
+  for(off = 0; off < na; off += nb) {
+    len = na - off < nb ? na - off : nb;
+    poly_mul(z, a + off, len, b, nb);
+    for(i = 0; i < len + nb - 1; i++)
+      field_add(r[off + i], r[off + i], z[i]);
+  }
+  field_vec_free(z, 2 * nb - 1);
 }
 
-/* calculate shares */
+/* r[0 .. n) = a * b mod X^n */
 
-void calculate_shares_r(const mpz_t coeff_rev[])
+void poly_mul_lo(mpz_t *r, const mpz_t *a, int na, const mpz_t *b, int nb,
+                 int n)
 {
-  unsigned int fmt_len;
-  mpz_t x, y;
+  mpz_t *z;
   int i;
-  for(fmt_len = 1, i = opt_number; i >= 10; i /= 10, fmt_len++);
-  mpz_init(x);
-  mpz_init(y);
-  for(i = 0; i < opt_number; i++) {
-    mpz_set_ui(x, i + 1);
-    horner_r(opt_threshold, y, x, coeff_rev);
-    if (opt_token)
-      fprintf(stdout, "%s-", opt_token);
-    fprintf(stdout, "%0*d-", fmt_len, i + 1);
-    field_print(stdout, y, 1);
-  }
-  mpz_clear(x);
-  mpz_clear(y);
+  na = na < n ? na : n;
+  nb = nb < n ? nb : n;
+  z = field_vec_xalloc(na + nb - 1);
+  poly_mul(z, a, na, b, nb);
+  for(i = 0; i < n; i++)
+    if (i < na + nb - 1)
+      mpz_swap(r[i], z[i]);
+    else
+      mpz_set_ui(r[i], 0);
+  field_vec_free(z, na + nb - 1);
 }
 
-/* ask for i-th share (*s - share size (in/out parameter)) */
-/* clears share on error, but leaves x */
+/* g[0 .. n) = 1 / h mod X^n for h[0] = 1, by Newton iteration. In
+ * characteristic 2 the step g' = 2g - h g^2 is just g' = h g^2, and
+ * squaring a polynomial only squares its coefficients. */
 
-enum ssss_errcode ask_share(mpz_t x, mpz_t share, unsigned *s, int i)
+void poly_inv(mpz_t *g, const mpz_t *h, int nh, int n)
 {
-  enum ssss_errcode ec = ssss_ec_ok;
-  char buf[MAXLINELEN];
-  char *a, *b;
-  int j;
-  assert(s);
-  if (! opt_quiet)
-    fprintf(stderr, "Share [%d/%d]: ", i + 1, opt_threshold);
-
-  if (! fgets(buf, sizeof(buf), stdin))
-    ec = ssss_err_io_reading_shares;
-  if (ec == ssss_ec_ok) {
-    buf[strcspn(buf, "\r\n")] = '\0';
-    if (! (b = strrchr(buf, '-')))
-      ec = ssss_err_invalid_syntax;
+  mpz_t *s;
+  int k, k2, i;
+  s = field_vec_xalloc(n);
+  mpz_set_ui(g[0], 1);
+  for(i = 1; i < n; i++)
+    mpz_set_ui(g[i], 0);
+  for(k = 1; k < n; k = k2) {
+    k2 = 2 * k < n ? 2 * k : n;
+    for(i = 0; i < k2; i++)
+      mpz_set_ui(s[i], 0);
+    for(i = 0; 2 * i < k2; i++)
+      field_mult(s[2 * i], g[i], g[i]);
+    poly_mul_lo(g, h, nh, s, k2, k2);
   }
+  field_vec_free(s, n);
+}
+
+/* subproduct tree over a set of evaluation points: every node holds the
+ * monic polynomial prod (X - x_i) over its points, the root over all of
+ * them. Reducing a polynomial modulo the nodes from the root downwards
+ * evaluates it at all points in O(M(m) log m) multiplications instead of
+ * the O(m n) of m separate Horner passes. */
+
+/* nodes with at most this many points are leaves, evaluated by Horner */
+#define PTREE_LEAF 8
+
+struct ptree_node {
+  int lo, hi;           /* points [lo, hi); no node if hi == 0 */
+  mpz_t *m;             /* hi - lo + 1 coefficients */
+  mpz_t *minv;          /* 1 / rev(m) mod X^ninv */
+  int ninv;
+};
+
+struct ptree {
+  int npoints, depth, nnodes;
+  unsigned long *points;
+  struct ptree_node *node;
+};
+
+void ptree_free(struct ptree *T)
+{
+  int v;
+  if (! T)
+    return;
+  for(v = 0; v < T->nnodes; v++)
+    if (T->node[v].hi) {
+      field_vec_free(T->node[v].m, T->node[v].hi - T->node[v].lo + 1);
+      field_vec_free(T->node[v].minv, T->node[v].ninv);
+    }
+  free(T->node);
+  free(T->points);
+  free(T);
+}
+
+void ptree_assign(struct ptree *T, int v, int lo, int hi)
+{
+  int mid;
+  T->node[v].lo = lo;
+  T->node[v].hi = hi;
+  T->node[v].m = field_vec_xalloc(hi - lo + 1);
+  if (v)
+    T->node[v].ninv = (T->node[(v - 1) / 2].hi - T->node[(v - 1) / 2].lo) -
+      (hi - lo);
+  if (T->node[v].ninv)
+    T->node[v].minv = field_vec_xalloc(T->node[v].ninv);
+  if (hi - lo > PTREE_LEAF) {
+    mid = lo + (hi - lo) / 2;
+    ptree_assign(T, 2 * v + 1, lo, mid);
+    ptree_assign(T, 2 * v + 2, mid, hi);
+  }
+}
+
+int ptree_is_leaf(const struct ptree *T, int v)
+{
+  return T->node[v].hi - T->node[v].lo <= PTREE_LEAF;
+}
+
+void ptree_build_nodes(void *arg, int lo, int hi)
+{
+  struct ptree *T = arg;
+  struct ptree_node *N;
+  mpz_t *rev, x, h;
+  int v, i, j, d;
+  mpz_init(x);
+  mpz_init(h);
+  for(v = lo; v < hi; v++) {
+    N = &T->node[v];
+    if (! N->hi)
+      continue;
+    d = N->hi - N->lo;
+    if (ptree_is_leaf(T, v)) {
+      /* multiply up the linear factors X - x_i one at a time */
+      mpz_set_ui(N->m[0], 1);
+      for(i = 0; i < d; i++) {
+        mpz_set_ui(x, T->points[N->lo + i]);
+        mpz_set_ui(N->m[i + 1], 0);
+        for(j = i + 1; j > 0; j--) {
+          field_mult(h, N->m[j], x);
+          field_add(N->m[j], N->m[j - 1], h);
+        }
+        field_mult(N->m[0], N->m[0], x);
+      }
+    }
+    else
+      poly_mul(N->m, (const mpz_t *)T->node[2 * v + 1].m,
+               T->node[2 * v + 1].hi - T->node[2 * v + 1].lo + 1,
+               (const mpz_t *)T->node[2 * v + 2].m,
+               T->node[2 * v + 2].hi - T->node[2 * v + 2].lo + 1);
+    if (N->ninv) {
+      rev = field_vec_xalloc(d + 1);
+      for(i = 0; i <= d; i++)
+        mpz_set(rev[i], N->m[d - i]);
+      poly_inv(N->minv, (const mpz_t *)rev, d + 1, N->ninv);
+      field_vec_free(rev, d + 1);
+    }
+  }
+  mpz_clear(x);
+  mpz_clear(h);
+}
+
+/* build the subproduct tree over points[0 .. npoints), NULL on failure;
+   free it with ptree_free() */
+
+struct ptree *ptree_build(const unsigned long *points, int npoints)
+{
+  struct ptree *T;
+  int size, l;
+  if (! (T = calloc(1, sizeof(struct ptree))))
+    return NULL;
+  for(size = npoints; size > PTREE_LEAF; size = (size + 1) / 2)
+    T->depth++;
+  T->nnodes = (2 << T->depth) - 1;
+  T->node = calloc(T->nnodes, sizeof(struct ptree_node));
+  T->points = malloc(npoints * sizeof(unsigned long));
+  if (! T->node || ! T->points) {
+    ptree_free(T);
+    return NULL;
+  }
+  T->npoints = npoints;
+  memcpy(T->points, points, npoints * sizeof(unsigned long));
+  ptree_assign(T, 0, 0, npoints);
+  for(l = T->depth; l >= 0; l--)
+    pool_for((1 << l) - 1, (2 << l) - 1, 1, ptree_build_nodes, T);
+  return T;
+}
+
+/* r[0 .. d) = f mod m for monic m of degree d, with the precomputed
+ * inverse of rev(m) if it is precise enough, else by long division */
+
+void poly_rem(mpz_t *r, const mpz_t *f, int nf, const mpz_t *m, int d,
+              const mpz_t *minv, int ninv)
+{
+  mpz_t *a, *q, h;
+  int nq = nf - d, i, j;
+  if (nq <= 0) {
+    for(i = 0; i < d; i++)
+      if (i < nf)
+        mpz_set(r[i], f[i]);
+      else
+        mpz_set_ui(r[i], 0);
+    return;
+  }
+  a = field_vec_xalloc(nq > d ? nq : d);
+  q = field_vec_xalloc(nq);
+  if (nq <= ninv) {
+    /* rev(q) = rev(f) / rev(m) mod X^nq */
+    for(i = 0; i < nq; i++)
+      mpz_set(a[i], f[nf - 1 - i]);
+    poly_mul_lo(q, (const mpz_t *)a, nq, minv, nq, nq);
+    for(i = 0; i < nq / 2; i++)
+      mpz_swap(q[i], q[nq - 1 - i]);
+    /* f - q m only matters mod X^d */
+    poly_mul_lo(a, (const mpz_t *)q, nq, m, d + 1, d);
+    for(i = 0; i < d; i++)
+      field_add(r[i], f[i], a[i]);
+  }
+  else {
+    mpz_t *t = field_vec_xalloc(nf);
+    mpz_init(h);
+    for(i = 0; i < nf; i++)
+      mpz_set(t[i], f[i]);
+    for(i = nf - 1; i >= d; i--)
+      for(j = 0; j < d; j++) {
+        field_mult(h, t[i], m[j]);
+        field_add(t[i - d + j], t[i - d + j], h);
+      }
+    for(i = 0; i < d; i++)
+      mpz_swap(r[i], t[i]);
+    mpz_clear(h);
+    field_vec_free(t, nf);
+  }
+  field_vec_free(a, nq > d ? nq : d);
+  field_vec_free(q, nq);
+}
+
+/* y[lo .. hi) = r evaluated at the points of leaf v, r of degree < hi - lo */
+
+void ptree_eval_leaf(const struct ptree *T, int v, const mpz_t *r, mpz_t *y)
+{
+  const struct ptree_node *N = &T->node[v];
+  int d = N->hi - N->lo, i, j;
+  mpz_t x;
+  mpz_init(x);
+  for(i = N->lo; i < N->hi; i++) {
+    mpz_set_ui(x, T->points[i]);
+    mpz_set(y[i], r[d - 1]);
+    for(j = d - 2; j >= 0; j--) {
+      field_mult(y[i], y[i], x);
+      field_add(y[i], y[i], r[j]);
+    }
+  }
+  mpz_clear(x);
+}
+
+struct mpeval_ctx {
+  const struct ptree *T;
+  mpz_t **rem;          /* remainder per node, hi - lo coefficients */
+  mpz_t *y;
+};
+
+void mpeval_nodes(void *arg, int lo, int hi)
+{
+  struct mpeval_ctx *c = arg;
+  const struct ptree_node *N, *P;
+  int v;
+  for(v = lo; v < hi; v++) {
+    N = &c->T->node[v];
+    if (! N->hi)
+      continue;
+    P = &c->T->node[(v - 1) / 2];
+    c->rem[v] = field_vec_xalloc(N->hi - N->lo);
+    poly_rem(c->rem[v], (const mpz_t *)c->rem[(v - 1) / 2], P->hi - P->lo,
+             (const mpz_t *)N->m, N->hi - N->lo, (const mpz_t *)N->minv,
+             N->ninv);
+    if (ptree_is_leaf(c->T, v))
+      ptree_eval_leaf(c->T, v, (const mpz_t *)c->rem[v], c->y);
+  }
+}
+
+/* y[i] = f(points[i]) for all points of the tree, f given as nf
+ * coefficients lowest first. Each level of the tree is one parallel loop,
+ * and the remainders of a level are freed once its children are done. */
+
+void mpeval(mpz_t *y, const struct ptree *T, const mpz_t *f, int nf)
+{
+  struct mpeval_ctx c = { T, NULL, y };
+  int l, v;
+  if (! (c.rem = calloc(T->nnodes, sizeof(mpz_t *))))
+    fatal_errcode(ssss_err_out_of_memory);
+  c.rem[0] = field_vec_xalloc(T->npoints);
+  poly_rem(c.rem[0], f, nf, (const mpz_t *)T->node[0].m, T->npoints, NULL, 0);
+  if (ptree_is_leaf(T, 0))
+    ptree_eval_leaf(T, 0, (const mpz_t *)c.rem[0], y);
+  for(l = 1; l <= T->depth; l++) {
+    pool_for((1 << l) - 1, (2 << l) - 1, 1, mpeval_nodes, &c);
+    for(v = (1 << (l - 1)) - 1; v < (1 << l) - 1; v++)
+      if (c.rem[v]) {
+        field_vec_free(c.rem[v], T->node[v].hi - T->node[v].lo);
+        c.rem[v] = NULL;
+      }
+  }
+  for(v = (1 << T->depth) - 1; v < T->nnodes; v++)
+    if (c.rem[v])
+      field_vec_free(c.rem[v], T->node[v].hi - T->node[v].lo);
+  free(c.rem);
+}
+
+/* whether mpeval() is likely faster than m Horner passes over n
+ * coefficients: building and descending the tree costs M(m)
+ * multiplications on each of its 1 + log2(m / PTREE_LEAF) levels, where
+ * M(m) = m^log2(3) is that of poly_mul(). The root has no inverse, so an
+ * input longer than m coefficients is first reduced by long division, at
+ * one multiplication per Horner step it replaces. The constant is fitted
+ * to 128 bit timings, where the tree wins from about 2048 shares and
+ * coefficients. The estimate is smooth, so the decision does not flip back
+ * and forth with growing m = n, although the actual timings jump at
+ * powers of two. */
+
+#define MPEVAL_COST 2.6
+
+int mpeval_pays_off(int m, int n)
+{
+  double tree, div;
+  if (m <= PTREE_LEAF)
+    return 0;
+  tree = MPEVAL_COST * pow(m, log2(3)) * (1 + log2((double)m / PTREE_LEAF));
+  div = n + 1 > m ? (double)(n + 1 - m) * m : 0;
+  return (double)m * n > tree + div;
+}
+
+struct horner_ctx {
+  int n;
+  const mpz_t *coeff_rev;
+  const unsigned long *x;
+  mpz_t *y;
+};
+
+void horner_points(void *arg, int lo, int hi)
+{
+  struct horner_ctx *c = arg;
+  mpz_t x;
+  int i;
+  mpz_init(x);
+  for(i = lo; i < hi; i++) {
+    mpz_set_ui(x, c->x[i]);
+    horner_r(c->n, c->y[i], x, c->coeff_rev);
+  }
+  mpz_clear(x);
+}
+
+/* y[i] = horner_r(n, x[i], coeff_rev) for i < m, by whichever method is
+ * faster; the results are the same */
+
+void horner_r_points(mpz_t *y, const unsigned long *x, int m, int n,
+                     const mpz_t coeff_rev[])
+{
+  struct horner_ctx c = { n, coeff_rev, x, y };
+  struct ptree *T;
+  mpz_t *f;
+  int i;
+  if (mpeval_pays_off(m, n) && (T = ptree_build(x, m))) {
+    /* the coefficients lowest first, including the extra x^n term */
+    f = field_vec_xalloc(n + 1);
+    for(i = 0; i < n; i++)
+      mpz_set(f[i], coeff_rev[n - 1 - i]);
+    mpz_set_ui(f[n], 1);
+    mpeval(y, T, (const mpz_t *)f, n + 1);
+    field_vec_free(f, n + 1);
+    ptree_free(T);
+  }
+  else
+    pool_for(0, m, pool_grain(m, 16), horner_points, &c);
+}
+
+/* ask for a secret */
+/* wipes secret on error */
+
+enum ssss_errcode ask_secret(mpz_t secret)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  char buf[MAXLINELEN];
+  int deg;
+  STATS_PHASE(STATS_INPUT);
+  if (! opt_quiet) {
+    deg = opt_security ? opt_security : MAXDEGREE;
+    fprintf(stderr, "Enter the secret, ");
+    if (opt_hex)
+      fprintf(stderr, "as most %d hex digits: ", deg / 4);
+    else
+      fprintf(stderr, "at most %d ASCII characters: ", deg / 8);
+  }
+  tcsetattr(0, TCSANOW, &echo_off);
+  if (! fgets(buf, sizeof(buf), stdin))
+    ec = ssss_err_io_reading_secret;
+  if (ec == ssss_ec_ok) {
+    tcsetattr(0, TCSANOW, &echo_orig);
+    fprintf(stderr, "\n");
+    buf[strcspn(buf, "\r\n")] = '\0';
+
+    if (! opt_security) {
+      opt_security = opt_hex ? 4 * ((strlen(buf) + 1) & ~1): 8 * strlen(buf);
+      if (! field_size_valid(opt_security))
+        ec = ssss_err_invalid_security_level;
+      if (ec == ssss_ec_ok) {
+        if (! opt_quiet)
+          fprintf(stderr, "Using a %d bit security level.\n", opt_security);
+      }
+    }
+  }
+
+  if (ec == ssss_ec_ok) {
+    field_init(opt_security);
+    ec = field_import(secret, buf, opt_hex);
+  } else
+    field_wipe(secret);
+
+  if (ec == ssss_ec_ok)
+    if (opt_diffusion) {
+      STATS_PHASE(STATS_DIFFUSION);
+      if (degree >= 64)
+        encode_mpz(secret, ENCODE);
+      else
+        warning("security level too small for the diffusion layer");
+    }
+
+  secure_zero(buf, sizeof(buf));
+  return ec;
+}
+
+enum ssss_errcode calculate_shares_r(int n, const mpz_t coeff_rev[]);
+
+/* Prompt for a secret, generate shares for it */
+
+enum ssss_errcode split(void)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  mpz_t *coeff;
+  int i;
+  if (! opt_quiet) {
+    fprintf(stderr, "Generating shares using a (%d,%d) scheme with ",
+            opt_threshold, opt_number);
+    if (opt_security)
+      fprintf(stderr, "a %d bit", opt_security);
+    else
+      fprintf(stderr, "dynamic");
+    fprintf(stderr, " security level.\n");
+  }
+  if (! (coeff = field_vec_alloc(opt_threshold)))
+    return ssss_err_out_of_memory;
+
+  ec = ask_secret(coeff[opt_threshold - 1]);
+
+  STATS_PHASE(STATS_ENTROPY);
+  if (ec == ssss_ec_ok)
+    ec = cprng_init();
+  for(i = opt_threshold - 2; i >= 0 && ec == ssss_ec_ok; i--)
+    ec = cprng_read(coeff[i]);
+  if (ec == ssss_ec_ok)
+    ec = cprng_deinit();
+
+  if (ec == ssss_ec_ok)
+    ec = calculate_shares_r(opt_threshold, (const mpz_t *)coeff);
+
+  field_vec_free(coeff, opt_threshold);
+  field_deinit();
+  return ec;
+}
+
+/* calculate shares of the polynomial with n coefficients coeff_rev (see
+   horner_r()), at the indices given with -i or all of them */
+
+enum ssss_errcode calculate_shares_r(int n, const mpz_t coeff_rev[])
+{
+  unsigned int fmt_len, i, m;
+  unsigned long *x = opt_index;
+  mpz_t *y;
+  if (! field_index_valid(opt_number))
+    return ssss_err_too_many_shares;
+  for(fmt_len = 1, i = opt_number; i >= 10; i /= 10, fmt_len++);
+  m = opt_index ? (unsigned)opt_nindex : (unsigned)opt_number;
+  if (! opt_index && (x = malloc(m * sizeof(unsigned long))))
+    for(i = 0; i < m; i++)
+      x[i] = i + 1;
+  if (! x || ! (y = field_vec_alloc(m))) {
+    if (x != opt_index)
+      free(x);
+    return ssss_err_out_of_memory;
+  }
+  STATS_PHASE(STATS_EVALUATION);
+  horner_r_points(y, x, m, n, coeff_rev);
+  STATS_PHASE(STATS_OUTPUT);
+  for(i = 0; i < m; i++) {
+    if (opt_token)
+      STATS_ADD(bytes, fprintf(stdout, "%s-", opt_token));
+    STATS_ADD(bytes, fprintf(stdout, "%0*lu-", fmt_len, x[i]));
+    field_print(stdout, y[i], 1);
+  }
+  field_vec_free(y, m);
+  if (x != opt_index)
+    free(x);
+  return ssss_ec_ok;
+}
+
+/* parse a share "[token-]index-value" (*s - share size (in/out
+   parameter)), buf is modified */
+/* wipes share on error, but leaves x */
+
+enum ssss_errcode parse_share(char *buf, mpz_t x, mpz_t share, unsigned *s)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  char *a, *b;
+  unsigned long j;
+  assert(s);
+  if (! (b = strrchr(buf, '-')))
+    ec = ssss_err_invalid_syntax;
   if (ec == ssss_ec_ok) {
     *b++ = 0;
     if ((a = strrchr(buf, '-')))
@@ -646,87 +1677,1706 @@ enum ssss_errcode ask_share(mpz_t x, mpz_t share, unsigned *s, int i)
         ec = ssss_err_shares_different_security_levels;
   }
 
-  if (ec == ssss_ec_ok) {
-    if (! (j = atoi(a)))
-      ec = ssss_err_invalid_share;
+  if (ec == ssss_ec_ok) {
+    j = strtoul(a, &a, 10);
+    if (*a || ! field_index_valid(j))
+      ec = ssss_err_invalid_share;
+  }
+  if (ec == ssss_ec_ok) {
+      mpz_set_ui(x, j);
+      ec = field_import(share, b, 1);
+  } else
+    field_wipe(share);
+  return ec;
+}
+
+/* ask for i-th of total shares (*s - share size (in/out parameter)) */
+/* wipes share on error, but leaves x */
+
+enum ssss_errcode ask_share(mpz_t x, mpz_t share, unsigned *s, int i,
+                            int total)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  char buf[MAXLINELEN];
+  STATS_PHASE(STATS_INPUT);
+  if (! opt_quiet)
+    fprintf(stderr, "Share [%d/%d]: ", i + 1, total);
+
+  if (! fgets(buf, sizeof(buf), stdin))
+    ec = ssss_err_io_reading_shares;
+  if (ec == ssss_ec_ok) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    ec = parse_share(buf, x, share, s);
+  } else
+    field_wipe(share);
+
+  secure_zero(buf, sizeof(buf));
+  return ec;
+}
+
+/* undo the diffusion layer and print the secret */
+
+void print_secret(mpz_t x)
+{
+  STATS_PHASE(STATS_DIFFUSION);
+  if (opt_diffusion) {
+    if (degree >= 64)
+      encode_mpz(x, DECODE);
+    else
+      warning("security level too small for the diffusion layer");
+  }
+  STATS_PHASE(STATS_OUTPUT);
+  if (! opt_quiet)
+    fprintf(stderr, "Resulting secret: ");
+  field_print(stdout, x, opt_hex);
+}
+
+/* Prompt for shares and calculate the secret by Lagrange interpolation */
+
+enum ssss_errcode combine_secret(void)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  mpz_t *x, *y, h;
+  int i;
+  unsigned s = 0;
+
+  x = field_vec_alloc(opt_threshold);
+  y = field_vec_alloc(opt_threshold);
+  if (! x || ! y)
+    ec = ssss_err_out_of_memory;
+
+  mpz_init(h);
+  if (ec == ssss_ec_ok && ! opt_quiet)
+    fprintf(stderr, "Enter %d shares separated by newlines:\n", opt_threshold);
+  for (i = 0; i < opt_threshold && ec == ssss_ec_ok; i++) {
+    ec = ask_share(x[i], y[i], &s, i, opt_threshold);
+    STATS_PHASE(STATS_INTERPOLATION);
+    if (ec == ssss_ec_ok) {
+      /* Remove x^k term. See comment at top of horner() */
+      field_pow_ui(h, x[i], opt_threshold);
+      field_add(y[i], y[i], h);
+    }
+  }
+  if (ec == ssss_ec_ok)
+    if (lagrange_secret(opt_threshold, (const mpz_t *)x, (const mpz_t *)y, h))
+      ec = ssss_err_inconsistent_shares;
+
+  if (ec == ssss_ec_ok)
+    print_secret(h);
+
+  mpz_clear(h);
+  field_vec_free(x, opt_threshold);
+  field_vec_free(y, opt_threshold);
+  field_deinit();
+  return ec;
+}
+
+/* Prompt for shares, calculate all coefficients and recalculate the
+ * shares. With with_secret set, the first "share" is the secret itself. */
+
+enum ssss_errcode combine(int with_secret)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  mpz_t *Av, *y, x;
+  int i, j;
+  unsigned s = 0;
+
+  Av = field_vec_alloc((size_t)opt_threshold * opt_threshold);
+  y = field_vec_alloc(opt_threshold);
+  if (! Av || ! y) {
+    field_vec_free(Av, (size_t)opt_threshold * opt_threshold);
+    field_vec_free(y, opt_threshold);
+    return ssss_err_out_of_memory;
+  }
+  mpz_t (*A)[opt_threshold] = (mpz_t (*)[opt_threshold])Av;
+
+  mpz_init(x);
+  if (! opt_quiet)
+    fprintf(stderr, "Enter %d shares separated by newlines:\n", opt_threshold);
+  for (i = 0; i < opt_threshold; i++) {
+    if (with_secret && i == 0) {
+      /* For recovering purpose treat the secret as a share. */
+      ec = ask_secret(y[i]);
+      if (ec != ssss_ec_ok)
+        break;
+      s = opt_security;
+      mpz_set_ui(x, 0);
+    } else {
+      ec = ask_share(x, y[i], &s, i, opt_threshold);
+      if (ec != ssss_ec_ok)
+        break;
+    }
+    STATS_PHASE(STATS_INTERPOLATION);
+    mpz_set_ui(A[opt_threshold - 1][i], 1);
+    for(j = opt_threshold - 2; j >= 0; j--)
+      field_mult(A[j][i], A[j + 1][i], x);
+    /* Remove x^k term. See comment at top of horner() */
+    field_mult(x, x, A[0][i]);
+    field_add(y[i], y[i], x);
+  }
+  if (ec == ssss_ec_ok)
+    if (restore_secret(opt_threshold, A, y, opt_recovery))
+      ec = ssss_err_inconsistent_shares;
+
+  if (ec == ssss_ec_ok) {
+    if (! with_secret) {
+      mpz_set(x, y[opt_threshold - 1]);
+      print_secret(x);
+    }
+    if (opt_recovery)
+      ec = calculate_shares_r(opt_threshold, (const mpz_t *)y);
+  }
+
+  mpz_clear(x);
+  field_vec_free(Av, (size_t)opt_threshold * opt_threshold);
+  field_vec_free(y, opt_threshold);
+  field_deinit();
+  return ec;
+}
+
+/* Packed secret sharing: k secrets are the values of one polynomial f of
+ * degree t + k - 2 at k points that are no share indices, 0 and the k - 1
+ * largest field elements. The shares are f evaluated at 1..n (plus the
+ * legacy x^(t + k - 1) term, see horner()). Any t + k - 1 shares determine
+ * f and so all secrets, while t - 1 shares or fewer reveal nothing about
+ * them; in between, shares leak partial information. Shares are as long
+ * as those of a single secret, and f costs about as much to evaluate as
+ * the polynomial of a single secret with threshold t + k - 1. */
+
+/* the point of the j-th packed secret */
+
+void packed_point(mpz_t x, int j)
+{
+  mpz_set_ui(x, 0);
+  if (j) {
+    mpz_setbit(x, degree);
+    mpz_sub_ui(x, x, j);
+  }
+}
+
+/* whether the packed points and the share indices 1..n are all distinct */
+
+int packed_points_valid(int k, int n)
+{
+  return field_index_valid(n) &&
+    (degree > 16 || (unsigned long)n + k - 1 < (1UL << degree));
+}
+
+/* Prompt for k secrets, generate shares of a polynomial through all of
+ * them */
+
+enum ssss_errcode split_packed(void)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  int k = opt_packed, m = opt_threshold + opt_packed - 1, i, j;
+  mpz_t *s, *p, *z, *zj, *q, *f, *g, h, c;
+  if (! opt_quiet) {
+    fprintf(stderr, "Generating shares using a packed (%d,%d) scheme for "
+            "%d secrets with ", opt_threshold, opt_number, k);
+    if (opt_security)
+      fprintf(stderr, "a %d bit", opt_security);
+    else
+      fprintf(stderr, "dynamic");
+    fprintf(stderr, " security level.\n"
+            "Any %d shares reconstruct all secrets, %d or fewer shares "
+            "reveal nothing about them.\n", m, opt_threshold - 1);
+  }
+  s = field_vec_alloc(k);
+  p = field_vec_alloc(k);
+  z = field_vec_alloc(k + 1);
+  zj = field_vec_alloc(k);
+  q = field_vec_alloc(opt_threshold - 1);
+  f = field_vec_alloc(m);
+  g = field_vec_alloc(m);
+  if (! s || ! p || ! z || ! zj || ! q || ! f || ! g)
+    ec = ssss_err_out_of_memory;
+  mpz_init(h);
+  mpz_init(c);
+
+  for(j = 0; j < k && ec == ssss_ec_ok; j++)
+    ec = ask_secret(s[j]);
+  if (ec == ssss_ec_ok && ! packed_points_valid(k, opt_number))
+    ec = ssss_err_too_many_shares;
+
+  if (ec == ssss_ec_ok) {
+    STATS_PHASE(STATS_INTERPOLATION);
+    /* z = prod_j (X - p_j) */
+    mpz_set_ui(z[0], 1);
+    for(j = 0; j < k; j++) {
+      packed_point(p[j], j);
+      for(i = j + 1; i > 0; i--) {
+        field_mult(h, z[i], p[j]);
+        field_add(z[i], z[i - 1], h);
+      }
+      field_mult(z[0], z[0], p[j]);
+    }
+    /* f = sum_j s_j z_j / z_j(p_j) with z_j = z / (X - p_j), the
+     * polynomial of degree k - 1 through the secrets */
+    for(j = 0; j < k; j++) {
+      mpz_set(zj[k - 1], z[k]);
+      for(i = k - 1; i > 0; i--) {
+        field_mult(h, zj[i], p[j]);
+        field_add(zj[i - 1], z[i], h);
+      }
+      mpz_set_ui(c, 1);
+      for(i = 0; i < k; i++)
+        if (i != j) {
+          field_add(h, p[j], p[i]);
+          field_mult(c, c, h);
+        }
+      field_invert(h, c);
+      field_mult(c, h, s[j]);
+      for(i = 0; i < k; i++) {
+        field_mult(h, zj[i], c);
+        field_add(f[i], f[i], h);
+      }
+    }
+  }
+
+  /* f += z q for random q of degree t - 2 */
+  STATS_PHASE(STATS_ENTROPY);
+  if (ec == ssss_ec_ok)
+    ec = cprng_init();
+  for(i = 0; i < opt_threshold - 1 && ec == ssss_ec_ok; i++)
+    ec = cprng_read(q[i]);
+  if (ec == ssss_ec_ok)
+    ec = cprng_deinit();
+
+  if (ec == ssss_ec_ok) {
+    STATS_PHASE(STATS_INTERPOLATION);
+    poly_mul(g, (const mpz_t *)z, k + 1, (const mpz_t *)q, opt_threshold - 1);
+    for(i = 0; i < m; i++)
+      field_add(f[i], f[i], g[i]);
+    /* highest coefficient first for horner_r() */
+    for(i = 0; i < m / 2; i++)
+      mpz_swap(f[i], f[m - 1 - i]);
+    ec = calculate_shares_r(m, (const mpz_t *)f);
+  }
+
+  mpz_clear(h);
+  mpz_clear(c);
+  field_vec_free(s, k);
+  field_vec_free(p, k);
+  field_vec_free(z, k + 1);
+  field_vec_free(zj, k);
+  field_vec_free(q, opt_threshold - 1);
+  field_vec_free(f, m);
+  field_vec_free(g, m);
+  field_deinit();
+  return ec;
+}
+
+/* Prompt for t + k - 1 shares of a packed scheme, calculate the k secrets */
+
+enum ssss_errcode combine_packed(void)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  int k = opt_packed, m = opt_threshold + opt_packed - 1, i;
+  mpz_t *x, *y, *p, *s, h;
+  unsigned sz = 0;
+
+  x = field_vec_alloc(m);
+  y = field_vec_alloc(m);
+  p = field_vec_alloc(k);
+  s = field_vec_alloc(k);
+  if (! x || ! y || ! p || ! s)
+    ec = ssss_err_out_of_memory;
+
+  mpz_init(h);
+  if (ec == ssss_ec_ok && ! opt_quiet)
+    fprintf(stderr, "Enter %d shares separated by newlines:\n", m);
+  for (i = 0; i < m && ec == ssss_ec_ok; i++) {
+    ec = ask_share(x[i], y[i], &sz, i, m);
+    STATS_PHASE(STATS_INTERPOLATION);
+    if (ec == ssss_ec_ok) {
+      /* Remove x^k term. See comment at top of horner() */
+      field_pow_ui(h, x[i], m);
+      field_add(y[i], y[i], h);
+    }
+  }
+  if (ec == ssss_ec_ok) {
+    for(i = 0; i < k; i++)
+      packed_point(p[i], i);
+    for(i = 0; i < m; i++)
+      if (! packed_points_valid(k, mpz_get_ui(x[i])))
+        ec = ssss_err_invalid_share;
+  }
+  if (ec == ssss_ec_ok)
+    if (lagrange_points(m, (const mpz_t *)x, (const mpz_t *)y,
+                        k, (const mpz_t *)p, s))
+      ec = ssss_err_inconsistent_shares;
+
+  for(i = 0; i < k && ec == ssss_ec_ok; i++)
+    print_secret(s[i]);
+
+  mpz_clear(h);
+  field_vec_free(x, m);
+  field_vec_free(y, m);
+  field_vec_free(p, k);
+  field_vec_free(s, k);
+  field_deinit();
+  return ec;
+}
+
+/* Batch modes work on a stream of share sets: the shares of one secret
+ * each, one per line, separated from the next set by an empty line. All
+ * shares of a stream have to be of the same security level. Sets are
+ * read and processed BATCH_SETS at a time, in parallel. */
+
+#define BATCH_SETS 256
+
+struct share_set {
+  int n, alloc;
+  char **prefix;        /* "token-index" as read, for the output */
+  mpz_t *x, *y;
+  enum ssss_errcode ec;
+};
+
+void share_set_clear(struct share_set *S)
+{
+  int i;
+  for(i = 0; i < S->n; i++)
+    free(S->prefix[i]);
+  field_vec_free(S->x, S->alloc);
+  field_vec_free(S->y, S->alloc);
+  free(S->prefix);
+  memset(S, 0, sizeof(*S));
+}
+
+/* make room for one more share */
+
+enum ssss_errcode share_set_grow(struct share_set *S)
+{
+  struct share_set T;
+  int i;
+  if (S->n < S->alloc)
+    return ssss_ec_ok;
+  T.alloc = S->alloc ? 2 * S->alloc : 8;
+  T.prefix = malloc(T.alloc * sizeof(char *));
+  T.x = field_vec_alloc(T.alloc);
+  T.y = field_vec_alloc(T.alloc);
+  if (! T.prefix || ! T.x || ! T.y) {
+    free(T.prefix);
+    field_vec_free(T.x, T.alloc);
+    field_vec_free(T.y, T.alloc);
+    return ssss_err_out_of_memory;
+  }
+  for(i = 0; i < S->n; i++) {
+    T.prefix[i] = S->prefix[i];
+    mpz_swap(T.x[i], S->x[i]);
+    mpz_swap(T.y[i], S->y[i]);
+  }
+  T.n = S->n;
+  S->n = 0;
+  share_set_clear(S);
+  *S = T;
+  S->ec = ssss_ec_ok;
+  return ssss_ec_ok;
+}
+
+/* read the next share set; S->n == 0 at the end of the stream */
+
+enum ssss_errcode read_share_set(FILE *stream, struct share_set *S,
+                                 unsigned *s)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  char buf[MAXLINELEN], *b;
+  /* the values are overwritten, but the prefixes of the last set are
+     separate allocations */
+  while (S->n)
+    free(S->prefix[--S->n]);
+  while (ec == ssss_ec_ok && fgets(buf, sizeof(buf), stream)) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    if (! *buf) {
+      if (S->n)
+        break;
+      continue;
+    }
+    if ((ec = share_set_grow(S)) != ssss_ec_ok)
+      break;
+    S->prefix[S->n] = NULL;
+    if ((b = strrchr(buf, '-')) &&
+        ! (S->prefix[S->n] = strndup(buf, b - buf)))
+      ec = ssss_err_out_of_memory;
+    if (ec == ssss_ec_ok)
+      ec = parse_share(buf, S->x[S->n], S->y[S->n], s);
+    if (ec == ssss_ec_ok)
+      S->n++;
+    else
+      free(S->prefix[S->n]);
+  }
+  if (ec == ssss_ec_ok && ferror(stream))
+    ec = ssss_err_io_reading_shares;
+  secure_zero(buf, sizeof(buf));
+  return ec;
+}
+
+void print_share_set(FILE *stream, const struct share_set *S)
+{
+  int i;
+  for(i = 0; i < S->n; i++) {
+    STATS_ADD(bytes, fprintf(stream, "%s-", S->prefix[i]));
+    field_print(stream, S->y[i], 1);
+  }
+}
+
+/* Proactive refresh: add to all shares of a secret the evaluations of a
+ * random polynomial of degree t - 1 with constant term zero. The new shares
+ * belong to the same secret and threshold, but don't combine with the old
+ * ones. The secret is never reconstructed. */
+
+void refresh_sets(void *arg, int lo, int hi)
+{
+  struct share_set *sets = arg, *S;
+  mpz_t *coeff, h;
+  int i, j;
+  coeff = field_vec_xalloc(opt_threshold);
+  mpz_init(h);
+  for(j = lo; j < hi; j++) {
+    S = &sets[j];
+    /* coeff[opt_threshold - 1], the constant term, stays zero */
+    for(i = 0; i < opt_threshold - 1 && S->ec == ssss_ec_ok; i++)
+      S->ec = cprng_read(coeff[i]);
+    for(i = 0; i < S->n && S->ec == ssss_ec_ok; i++) {
+      horner_r(opt_threshold, h, S->x[i], (const mpz_t *)coeff);
+      field_add(S->y[i], S->y[i], h);
+      /* horner_r() adds x^t, which is part of the share already */
+      field_pow_ui(h, S->x[i], opt_threshold);
+      field_add(S->y[i], S->y[i], h);
+    }
+  }
+  mpz_clear(h);
+  field_vec_free(coeff, opt_threshold);
+}
+
+enum ssss_errcode refresh(void)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  struct share_set *sets;
+  int nsets, i, first = 1;
+  unsigned s = 0;
+
+  if (! (sets = calloc(BATCH_SETS, sizeof(struct share_set))))
+    return ssss_err_out_of_memory;
+  ec = cprng_init();
+  while (ec == ssss_ec_ok) {
+    STATS_PHASE(STATS_INPUT);
+    for(nsets = 0; nsets < BATCH_SETS && ec == ssss_ec_ok; nsets++) {
+      ec = read_share_set(stdin, &sets[nsets], &s);
+      if (! sets[nsets].n)
+        break;
+    }
+    if (ec != ssss_ec_ok || ! nsets)
+      break;
+
+    STATS_PHASE(STATS_EVALUATION);
+    pool_for(0, nsets, pool_grain(nsets, 1), refresh_sets, sets);
+
+    STATS_PHASE(STATS_OUTPUT);
+    for(i = 0; i < nsets && ec == ssss_ec_ok; i++) {
+      if ((ec = sets[i].ec) != ssss_ec_ok)
+        break;
+      if (! first)
+        STATS_ADD(bytes, fprintf(stdout, "\n"));
+      print_share_set(stdout, &sets[i]);
+      first = 0;
+    }
+  }
+  if (ec == ssss_ec_ok)
+    ec = cprng_deinit();
+
+  for(i = 0; i < BATCH_SETS; i++)
+    share_set_clear(&sets[i]);
+  free(sets);
+  if (degree)
+    field_deinit();
+  return ec;
+}
+
+/* Audit: check that all shares of each set lie on one polynomial of
+ * degree t - 1, without reconstructing the secret. The first t shares of
+ * a set are the base; every other share must equal the value the base
+ * interpolates at its index. With the extra x^t term removed that is the
+ * syndrome
+ *
+ *   s_l = y_l + x_l^t + sum_i L_i(x_l) (y_i + x_i^t) = y_l + q_l + sum_i C_li y_i
+ *
+ * which has to be zero. C and q only depend on the indices, so they are
+ * computed once per index set and cached; checking a set then costs
+ * (n - t) * t multiplications. */
+
+struct audit_basis {
+  int n;
+  unsigned long *x;     /* the index set */
+  mpz_t *C, *q;         /* (n - t) x t weights, n - t offsets */
+  int dup, used;
+  struct audit_basis *next;
+};
+
+enum audit_status {
+  AUDIT_OK,
+  AUDIT_BAD,            /* the shares flagged in bad[] don't fit */
+  AUDIT_UNLOCATED,      /* inconsistent, no consistent base found */
+  AUDIT_TOO_FEW,
+  AUDIT_DUPLICATE
+};
+
+struct audit_job {
+  struct share_set *S;
+  struct audit_basis *B;
+  enum audit_status status;
+  char *bad;
+};
+
+int ulong_cmp(const void *a, const void *b)
+{
+  unsigned long u = *(const unsigned long *)a, v = *(const unsigned long *)b;
+  return (u > v) - (u < v);
+}
+
+void audit_basis_clear(struct audit_basis *B)
+{
+  int k = B->n - opt_threshold;
+  field_vec_free(B->C, (size_t)k * opt_threshold);
+  field_vec_free(B->q, k);
+  free(B->x);
+}
+
+/* set up the basis of the n > t indices x */
+
+void audit_basis_init(struct audit_basis *B, int n, const mpz_t x[])
+{
+  int t = opt_threshold, k = n - t, i, l;
+  unsigned long *sorted;
+  mpz_t *pw, h;
+  memset(B, 0, sizeof(*B));
+  B->n = n;
+  if (! (B->x = malloc(n * sizeof(unsigned long))) ||
+      ! (sorted = malloc(n * sizeof(unsigned long))))
+    fatal_errcode(ssss_err_out_of_memory);
+  for(i = 0; i < n; i++)
+    sorted[i] = B->x[i] = mpz_get_ui(x[i]);
+  qsort(sorted, n, sizeof(unsigned long), ulong_cmp);
+  for(i = 1; i < n; i++)
+    B->dup = B->dup || sorted[i] == sorted[i - 1];
+  free(sorted);
+  B->C = field_vec_xalloc((size_t)k * t);
+  B->q = field_vec_xalloc(k);
+  if (B->dup)
+    return;
+  lagrange_basis(t, x, k, x + t, B->C);
+  pw = field_vec_xalloc(n);
+  mpz_init(h);
+  for(i = 0; i < n; i++)
+    field_pow_ui(pw[i], x[i], t);
+  for(l = 0; l < k; l++) {
+    mpz_set(B->q[l], pw[t + l]);
+    for(i = 0; i < t; i++) {
+      field_mult(h, B->C[(size_t)l * t + i], pw[i]);
+      field_add(B->q[l], B->q[l], h);
+    }
+  }
+  mpz_clear(h);
+  field_vec_free(pw, n);
+}
+
+/* flag the shares after the base with a nonzero syndrome in bad[], return
+   their number */
+
+int audit_syndromes(const struct audit_basis *B, const mpz_t y[], char *bad)
+{
+  int t = opt_threshold, i, l, nbad = 0;
+  mpz_t s, h;
+  mpz_init(s);
+  mpz_init(h);
+  memset(bad, 0, B->n);
+  for(l = 0; l < B->n - t; l++) {
+    field_add(s, y[t + l], B->q[l]);
+    for(i = 0; i < t; i++) {
+      field_mult(h, B->C[(size_t)l * t + i], y[i]);
+      field_add(s, s, h);
+    }
+    if ((bad[t + l] = mpz_cmp_ui(s, 0) != 0))
+      nbad++;
+  }
+  mpz_clear(s);
+  mpz_clear(h);
+  return nbad;
+}
+
+/* solve the rows x cols system with augmented matrix M (rows x (cols + 1),
+   row-major) by Gaussian elimination. Unknowns the system leaves free are
+   set to zero. Returns -1 if there is no solution. M is destroyed. */
+
+int gauss_solve(int rows, int cols, mpz_t *M, mpz_t sol[])
+{
+  size_t w = cols + 1;
+  int r, c, i, j, *pivot, ret = 0;
+  mpz_t f, h;
+  if (! (pivot = malloc(cols * sizeof(int))))
+    fatal_errcode(ssss_err_out_of_memory);
+  mpz_init(f);
+  mpz_init(h);
+  /* row echelon form with leading ones */
+  for(r = c = 0; c < cols; c++) {
+    pivot[c] = -1;
+    for(i = r; i < rows && ! mpz_cmp_ui(M[i * w + c], 0); i++);
+    if (i == rows)
+      continue;
+    if (i != r)
+      for(j = c; j <= cols; j++)
+        mpz_swap(M[i * w + j], M[r * w + j]);
+    field_invert(f, M[r * w + c]);
+    for(j = c; j <= cols; j++)
+      field_mult(M[r * w + j], M[r * w + j], f);
+    for(i = r + 1; i < rows; i++)
+      if (mpz_cmp_ui(M[i * w + c], 0)) {
+        mpz_set(f, M[i * w + c]);
+        for(j = c; j <= cols; j++) {
+          field_mult(h, f, M[r * w + j]);
+          field_add(M[i * w + j], M[i * w + j], h);
+        }
+      }
+    pivot[c] = r++;
+  }
+  for(i = r; i < rows; i++)
+    if (mpz_cmp_ui(M[i * w + cols], 0))
+      ret = -1;
+  /* back substitution */
+  for(c = cols - 1; c >= 0 && ! ret; c--) {
+    mpz_set_ui(sol[c], 0);
+    if ((r = pivot[c]) < 0)
+      continue;
+    mpz_set(sol[c], M[r * w + cols]);
+    for(j = c + 1; j < cols; j++) {
+      field_mult(h, M[r * w + j], sol[j]);
+      field_add(sol[c], sol[c], h);
+    }
+  }
+  free(pivot);
+  mpz_clear(f);
+  mpz_clear(h);
+  return ret;
+}
+
+/* Too many shares failed the check, the base may hold bad shares itself.
+   Decode with Berlekamp-Welch: with y_i the shares with x^t removed, find
+   a Q of degree < t + e and a monic E of degree e with Q(x_i) = y_i E(x_i)
+   for the first t + 2e shares. If there are at most e bad shares, Q / E is
+   the polynomial through the good ones for any solution, and checking all
+   shares against it finds them. e doubles up to (n - t) / 2, the most bad
+   shares that can be located wherever they are; with more, the set is
+   only known to be inconsistent. Not cached, this should be rare. */
+
+enum audit_status audit_locate(const struct share_set *S, char *bad)
+{
+  enum audit_status status = AUDIT_UNLOCATED;
+  int n = S->n, t = opt_threshold, emax = (n - t) / 2, e, u, i, k, ok, nbad;
+  mpz_t *y, *M, *sol, *row, h, xp;
+  y = field_vec_xalloc(n);
+  mpz_init(h);
+  mpz_init(xp);
+  for(i = 0; i < n; i++) {
+    field_pow_ui(h, S->x[i], t);
+    field_add(y[i], S->y[i], h);
+  }
+  for(e = 1; status == AUDIT_UNLOCATED && e <= emax;
+      e = e < emax && 2 * e > emax ? emax : 2 * e) {
+    u = t + 2 * e;
+    M = field_vec_xalloc((size_t)u * (u + 1));
+    sol = field_vec_xalloc(u);
+    /* unknowns: Q lowest first, then E without its leading 1 */
+    for(i = 0; i < u; i++) {
+      row = M + (size_t)i * (u + 1);
+      mpz_set_ui(xp, 1);
+      for(k = 0; k < t + e; k++) {
+        mpz_set(row[k], xp);
+        if (k < e)
+          field_mult(row[t + e + k], y[i], xp);
+        else if (k == e)
+          field_mult(row[u], y[i], xp);
+        field_mult(xp, xp, S->x[i]);
+      }
+    }
+    if (! gauss_solve(u, u, M, sol)) {
+      /* P = Q / E in place of Q, the remainder has to vanish */
+      for(k = t + e - 1; k >= e; k--)
+        for(i = 0; i < e; i++) {
+          field_mult(h, sol[k], sol[t + e + i]);
+          field_add(sol[k - e + i], sol[k - e + i], h);
+        }
+      for(ok = 1, k = 0; k < e; k++)
+        ok = ok && ! mpz_cmp_ui(sol[k], 0);
+      for(nbad = i = 0; i < n && ok; i++) {
+        mpz_set_ui(h, 0);
+        for(k = t + e - 1; k >= e; k--) {
+          field_mult(xp, h, S->x[i]);
+          field_add(h, xp, sol[k]);
+        }
+        nbad += (bad[i] = mpz_cmp(h, y[i]) != 0);
+      }
+      if (ok && nbad && nbad <= e)
+        status = AUDIT_BAD;
+    }
+    field_vec_free(M, (size_t)u * (u + 1));
+    field_vec_free(sol, u);
+  }
+  mpz_clear(h);
+  mpz_clear(xp);
+  field_vec_free(y, n);
+  return status;
+}
+
+void audit_sets(void *arg, int lo, int hi)
+{
+  struct audit_job *jobs = arg, *J;
+  int nbad;
+  for(; lo < hi; lo++) {
+    J = &jobs[lo];
+    if (J->status != AUDIT_OK)
+      continue;
+    /* two polynomials of degree < t agree on at most t - 1 indices, so
+       with up to (n - t) / 2 failures the base is good */
+    nbad = audit_syndromes(J->B, (const mpz_t *)J->S->y, J->bad);
+    if (2 * nbad > J->S->n - opt_threshold)
+      J->status = audit_locate(J->S, J->bad);
+    else if (nbad)
+      J->status = AUDIT_BAD;
   }
-  if (ec == ssss_ec_ok) {
-      mpz_set_ui(x, j);
-      ec = field_import(share, b, 1);
-  } else
-    mpz_clear(share);
+}
 
-  secure_zero(buf, sizeof(buf));
-  return ec;
+/* find the basis for the indices of S, or set one up. Bases not used
+   by the current batch are dropped by audit_cache_trim(). */
+
+struct audit_basis *audit_cache_get(struct audit_basis **cache,
+                                    const struct share_set *S)
+{
+  struct audit_basis *B;
+  int i;
+  for(B = *cache; B; B = B->next) {
+    for(i = 0; B->n == S->n && i < S->n; i++)
+      if (mpz_cmp_ui(S->x[i], B->x[i]))
+        break;
+    if (B->n == S->n && i == S->n)
+      break;
+  }
+  if (! B) {
+    if (! (B = malloc(sizeof(struct audit_basis))))
+      fatal_errcode(ssss_err_out_of_memory);
+    audit_basis_init(B, S->n, (const mpz_t *)S->x);
+    B->next = *cache;
+    *cache = B;
+  }
+  B->used = 1;
+  return B;
+}
+
+void audit_cache_trim(struct audit_basis **cache, int all)
+{
+  struct audit_basis *B;
+  while ((B = *cache))
+    if (all || ! B->used) {
+      *cache = B->next;
+      audit_basis_clear(B);
+      free(B);
+    }
+    else {
+      B->used = 0;
+      cache = &B->next;
+    }
 }
 
-/* Prompt for shares, calculate the secret, recalculate same shares
- * if necessary */
+void audit_report(FILE *stream, unsigned long set, const struct audit_job *J)
+{
+  int i, first = 1;
+  STATS_ADD(bytes, fprintf(stream, "set %lu: ", set));
+  switch(J->status) {
+  case AUDIT_BAD:
+    STATS_ADD(bytes, fprintf(stream, "bad shares"));
+    for(i = 0; i < J->S->n; i++)
+      if (J->bad[i]) {
+        STATS_ADD(bytes, fprintf(stream, "%s", first ? " " : ","));
+        STATS_ADD(bytes, mpz_out_str(stream, 10, J->S->x[i]));
+        first = 0;
+      }
+    break;
+  case AUDIT_UNLOCATED:
+    STATS_ADD(bytes, fprintf(stream, "shares inconsistent, bad shares not found"));
+    break;
+  case AUDIT_TOO_FEW:
+    STATS_ADD(bytes, fprintf(stream, "not enough shares to check"));
+    break;
+  case AUDIT_DUPLICATE:
+    STATS_ADD(bytes, fprintf(stream, "duplicate share indices"));
+    break;
+  default:
+    break;
+  }
+  STATS_ADD(bytes, fprintf(stream, "\n"));
+}
 
-enum ssss_errcode combine(int with_secret)
+enum ssss_errcode audit(void)
 {
   enum ssss_errcode ec = ssss_ec_ok;
-  mpz_t A[opt_threshold][opt_threshold], y[opt_threshold], x;
-  int i, j;
+  struct share_set *sets;
+  struct audit_job *jobs;
+  struct audit_basis *cache = NULL;
+  unsigned long nset = 0, nfailed = 0;
+  int nsets, i;
   unsigned s = 0;
 
-  mpz_init(x);
-  if (! opt_quiet)
-    fprintf(stderr, "Enter %d shares separated by newlines:\n", opt_threshold);
-  for (i = 0; i < opt_threshold; i++) {
-    mpz_init(y[i]);
-    if (with_secret && i == 0) {
-      /* For recovering purpose treat the secret as a share. */
-      ec = ask_secret(y[i]);
-      if (ec != ssss_ec_ok)
+  sets = calloc(BATCH_SETS, sizeof(struct share_set));
+  jobs = calloc(BATCH_SETS, sizeof(struct audit_job));
+  if (! sets || ! jobs) {
+    free(sets);
+    return ssss_err_out_of_memory;
+  }
+  while (ec == ssss_ec_ok) {
+    STATS_PHASE(STATS_INPUT);
+    for(nsets = 0; nsets < BATCH_SETS && ec == ssss_ec_ok; nsets++) {
+      ec = read_share_set(stdin, &sets[nsets], &s);
+      if (! sets[nsets].n)
         break;
-      s = opt_security;
-      mpz_set_ui(x, 0);
-    } else {
-      ec = ask_share(x, y[i], &s, i);
-      if (ec != ssss_ec_ok)
+    }
+    if (ec != ssss_ec_ok || ! nsets)
+      break;
+
+    STATS_PHASE(STATS_INTERPOLATION);
+    for(i = 0; i < nsets; i++) {
+      jobs[i].S = &sets[i];
+      jobs[i].B = NULL;
+      jobs[i].status = AUDIT_OK;
+      if (sets[i].n <= opt_threshold)
+        jobs[i].status = AUDIT_TOO_FEW;
+      else if ((jobs[i].B = audit_cache_get(&cache, &sets[i]))->dup)
+        jobs[i].status = AUDIT_DUPLICATE;
+      else if (! (jobs[i].bad = malloc(sets[i].n)))
+        fatal_errcode(ssss_err_out_of_memory);
+    }
+    STATS_PHASE(STATS_EVALUATION);
+    pool_for(0, nsets, pool_grain(nsets, 1), audit_sets, jobs);
+
+    STATS_PHASE(STATS_OUTPUT);
+    for(i = 0; i < nsets; i++) {
+      nset++;
+      if (jobs[i].status != AUDIT_OK) {
+        audit_report(stdout, nset, &jobs[i]);
+        nfailed++;
+      }
+      free(jobs[i].bad);
+      jobs[i].bad = NULL;
+    }
+    audit_cache_trim(&cache, 0);
+  }
+  if (ec == ssss_ec_ok && ! opt_quiet)
+    fprintf(stderr, "Checked %lu share sets, %lu failed.\n", nset, nfailed);
+  if (ec == ssss_ec_ok && nfailed)
+    ec = ssss_err_audit_failed;
+
+  audit_cache_trim(&cache, 1);
+  for(i = 0; i < BATCH_SETS; i++)
+    share_set_clear(&sets[i]);
+  free(sets);
+  free(jobs);
+  if (degree)
+    field_deinit();
+  return ec;
+}
+
+/* Batch split: one secret per input line, the shares of each printed as a
+ * share set (see above). The work runs as a pipeline of threads
+ *
+ *   entropy -> reader -> compute workers -> writer
+ *
+ * that hand jobs on through bounded lock-free queues. A job carries the
+ * coefficients of one polynomial and the text of its shares; after being
+ * written it goes back to a locked free list, where the entropy stage
+ * picks it up again. Workers finish out of order, the writer restores the
+ * input order. */
+
+#define PIPE_JOBS_PER_WORKER 4
+
+/* all jobs together may take this many bytes, but there is at least one;
+   with large share sets this caps the jobs in flight below the above */
+#define PIPE_MEMORY (64 << 20)
+
+struct pipe_job {
+  unsigned long seq;
+  enum ssss_errcode ec;
+  mpz_t *coeff;         /* coeff_rev of horner_r(), the secret last */
+  char *out;
+  size_t len;
+};
+
+/* bounded multi-producer multi-consumer queue of jobs after D. Vyukov.
+   The queues are larger than the number of jobs in existence, so pushing
+   never fails; consumers sleep on a semaphore counting the jobs. */
+
+struct pipe_cell {
+  atomic_size_t seq;
+  struct pipe_job *job;
+};
+
+struct pipe_queue {
+  struct pipe_cell *cell;
+  size_t mask;
+  atomic_size_t head, tail;
+  sem_t items;
+};
+
+int pipe_queue_init(struct pipe_queue *q, size_t size)
+{
+  size_t i;
+  for(q->mask = 1; q->mask < size; q->mask *= 2);
+  if (! (q->cell = malloc(q->mask * sizeof(struct pipe_cell))))
+    return -1;
+  for(i = 0; i < q->mask; i++)
+    atomic_init(&q->cell[i].seq, i);
+  q->mask--;
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  sem_init(&q->items, 0, 0);
+  return 0;
+}
+
+void pipe_queue_deinit(struct pipe_queue *q)
+{
+  sem_destroy(&q->items);
+  free(q->cell);
+}
+
+void pipe_push(struct pipe_queue *q, struct pipe_job *job)
+{
+  struct pipe_cell *c;
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  for(;;) {
+    c = &q->cell[pos & q->mask];
+    if (atomic_load_explicit(&c->seq, memory_order_acquire) == pos) {
+      if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
         break;
     }
-    mpz_init_set_ui(A[opt_threshold - 1][i], 1);
-    for(j = opt_threshold - 2; j >= 0; j--) {
-      mpz_init(A[j][i]);
-      field_mult(A[j][i], A[j + 1][i], x);
+    else
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  }
+  c->job = job;
+  atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+  sem_post(&q->items);
+}
+
+struct pipe_job *pipe_pop(struct pipe_queue *q)
+{
+  struct pipe_cell *c;
+  struct pipe_job *job;
+  size_t pos;
+  while (sem_wait(&q->items) && errno == EINTR);
+  /* a job is there, but the cell at the head may still be being written
+     by a producer that claimed it first */
+  pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+  for(;;) {
+    c = &q->cell[pos & q->mask];
+    if (atomic_load_explicit(&c->seq, memory_order_acquire) == pos + 1) {
+      if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
     }
-    /* Remove x^k term. See comment at top of horner() */
-    field_mult(x, x, A[0][i]);
-    field_add(y[i], y[i], x);
+    else
+      pos = atomic_load_explicit(&q->head, memory_order_relaxed);
   }
-  if (ec == ssss_ec_ok)
-    if (restore_secret(opt_threshold, A, y, opt_recovery))
-      ec = ssss_err_inconsistent_shares;
+  job = c->job;
+  atomic_store_explicit(&c->seq, pos + q->mask + 1, memory_order_release);
+  return job;
+}
 
-  if (ec == ssss_ec_ok) {
-    if (! with_secret) {
-      mpz_set(x, y[opt_threshold - 1]);
-      if (opt_diffusion) {
-        if (degree >= 64)
-          encode_mpz(x, DECODE);
-        else
-          warning("security level too small for the diffusion layer");
+struct {
+  int nworkers, njobs;
+  struct pipe_job *jobs, end;   /* &end marks the end of a stream */
+  struct pipe_job **ring;
+  struct pipe_queue fresh, work, done;
+  unsigned fmt_len;
+  size_t out_size;
+  atomic_int failed;
+  /* the free list */
+  pthread_mutex_t lock;
+  pthread_cond_t avail;
+  struct pipe_job **free;
+  int nfree, closed;
+} pipeline = { .lock = PTHREAD_MUTEX_INITIALIZER,
+            .avail = PTHREAD_COND_INITIALIZER };
+
+/* take a job off the free list; NULL once the list is closed */
+
+struct pipe_job *pipe_get_free(void)
+{
+  struct pipe_job *job = NULL;
+  pthread_mutex_lock(&pipeline.lock);
+  while (! pipeline.nfree && ! pipeline.closed)
+    pthread_cond_wait(&pipeline.avail, &pipeline.lock);
+  if (! pipeline.closed)
+    job = pipeline.free[--pipeline.nfree];
+  pthread_mutex_unlock(&pipeline.lock);
+  return job;
+}
+
+void pipe_put_free(struct pipe_job *job)
+{
+  pthread_mutex_lock(&pipeline.lock);
+  pipeline.free[pipeline.nfree++] = job;
+  pthread_cond_signal(&pipeline.avail);
+  pthread_mutex_unlock(&pipeline.lock);
+}
+
+void pipe_close_free(void)
+{
+  pthread_mutex_lock(&pipeline.lock);
+  pipeline.closed = 1;
+  pthread_cond_broadcast(&pipeline.avail);
+  pthread_mutex_unlock(&pipeline.lock);
+}
+
+/* entropy stage: fill the random coefficients of free jobs ahead of the
+   reader */
+
+void *pipe_entropy(void *unused)
+{
+  struct pipe_job *job;
+  int i;
+  (void)unused;
+  while ((job = pipe_get_free())) {
+    for(i = 0; i < opt_threshold - 1 && job->ec == ssss_ec_ok; i++)
+      job->ec = cprng_read(job->coeff[i]);
+    pipe_push(&pipeline.fresh, job);
+  }
+  STATS_FLUSH();
+  return NULL;
+}
+
+/* compute stage: diffusion layer, evaluation and formatting of the
+   shares */
+
+void *pipe_worker(void *unused)
+{
+  struct pipe_job *job;
+  unsigned long j;
+  char *p;
+  mpz_t x, y;
+  (void)unused;
+  mpz_init(x);
+  mpz_init(y);
+  while ((job = pipe_pop(&pipeline.work)) != &pipeline.end) {
+    if (job->ec != ssss_ec_ok || atomic_load(&pipeline.failed)) {
+      pipe_push(&pipeline.done, job);
+      continue;
+    }
+    if (opt_diffusion && degree >= 64)
+      encode_mpz(job->coeff[opt_threshold - 1], ENCODE);
+    p = job->out;
+    for(j = 1; j <= (unsigned long)opt_number; j++) {
+      mpz_set_ui(x, j);
+      horner_r(opt_threshold, y, x, (const mpz_t *)job->coeff);
+      if (opt_token)
+        p += sprintf(p, "%s-", opt_token);
+      p += sprintf(p, "%0*lu-", (int)pipeline.fmt_len, j);
+      memset(p, '0', degree / 4 - mpz_sizeinbase(y, 16));
+      p += degree / 4 - mpz_sizeinbase(y, 16);
+      mpz_get_str(p, 16, y);
+      p += strlen(p);
+      *p++ = '\n';
+    }
+    job->len = p - job->out;
+    pipe_push(&pipeline.done, job);
+  }
+  pipe_push(&pipeline.done, &pipeline.end);
+  mpz_clear(x);
+  mpz_clear(y);
+  STATS_FLUSH();
+  return NULL;
+}
+
+/* writer stage: print the share sets in input order and recycle the jobs.
+   The jobs in flight have consecutive sequence numbers, so they can be
+   held back in a ring of njobs slots. */
+
+void *pipe_writer(void *arg)
+{
+  enum ssss_errcode *ec = arg;
+  struct pipe_job **ring = pipeline.ring, *job;
+  unsigned long next = 0;
+  int ends = 0;
+  while (ends < pipeline.nworkers) {
+    if ((job = pipe_pop(&pipeline.done)) == &pipeline.end) {
+      ends++;
+      continue;
+    }
+    ring[job->seq % pipeline.njobs] = job;
+    while ((job = ring[next % pipeline.njobs]) && job->seq == next) {
+      ring[next % pipeline.njobs] = NULL;
+      if (*ec == ssss_ec_ok && (*ec = job->ec) != ssss_ec_ok)
+        atomic_store(&pipeline.failed, 1);
+      if (*ec == ssss_ec_ok) {
+        if (next)
+          fputc('\n', stdout);
+        fwrite(job->out, 1, job->len, stdout);
+        STATS_ADD(bytes, job->len + ! ! next);
       }
-      if (! opt_quiet)
-        fprintf(stderr, "Resulting secret: ");
-      field_print(stdout, x, opt_hex);
+      secure_zero(job->out, job->len);
+      job->len = 0;
+      job->ec = ssss_ec_ok;
+      pipe_put_free(job);
+      next++;
     }
-    if (opt_recovery)
-      calculate_shares_r(y);
   }
+  STATS_FLUSH();
+  return NULL;
+}
 
-  mpz_clear(x);
-  for (i = i - 1; i >= 0; i--) {
-    for (j = opt_threshold - 1; j >= 0; j--)
-      mpz_clear(A[j][i]);
-    mpz_clear(y[i]);
+/* reader stage, run by the calling thread: parse secrets into jobs with
+   their random coefficients ready */
+
+enum ssss_errcode pipe_read(void)
+{
+  enum ssss_errcode ec = ssss_ec_ok;
+  struct pipe_job *job;
+  char buf[MAXLINELEN];
+  unsigned long seq = 0;
+  while (! atomic_load(&pipeline.failed) && fgets(buf, sizeof(buf), stdin)) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    job = pipe_pop(&pipeline.fresh);
+    job->seq = seq++;
+    if (job->ec == ssss_ec_ok)
+      job->ec = field_import(job->coeff[opt_threshold - 1], buf, opt_hex);
+    pipe_push(&pipeline.work, job);
   }
+  if (ferror(stdin))
+    ec = ssss_err_io_reading_secret;
+  secure_zero(buf, sizeof(buf));
+  return ec;
+}
+
+enum ssss_errcode split_batch(void)
+{
+  enum ssss_errcode ec, wec = ssss_ec_ok;
+  pthread_t entropy, writer, *workers;
+  pthread_attr_t attr;
+  size_t job_size;
+  int i, w = 0, started = 0;
+
+  field_init(opt_security);
+  if (! field_index_valid(opt_number)) {
+    field_deinit();
+    return ssss_err_too_many_shares;
+  }
+  if (opt_diffusion && degree < 64)
+    warning("security level too small for the diffusion layer");
+  if ((ec = cprng_init()) != ssss_ec_ok) {
+    field_deinit();
+    return ec;
+  }
+
+  pipeline.nworkers = opt_threads > 0 ? opt_threads : pool_default_threads();
+  for(pipeline.fmt_len = 1, i = opt_number; i >= 10; i /= 10, pipeline.fmt_len++);
+  pipeline.out_size = (size_t)opt_number * ((opt_token ? strlen(opt_token) + 1 :
+                                          0) + pipeline.fmt_len + 1 +
+                                         degree / 4 + 1) + 1;
+  job_size = pipeline.out_size +
+    (size_t)opt_threshold * (sizeof(mpz_t) + degree / 8);
+  pipeline.njobs = PIPE_JOBS_PER_WORKER * pipeline.nworkers + 2;
+  if ((size_t)pipeline.njobs > PIPE_MEMORY / job_size)
+    pipeline.njobs = PIPE_MEMORY / job_size > 0 ? PIPE_MEMORY / job_size : 1;
+  /* more workers than jobs would only wait */
+  if (pipeline.nworkers > pipeline.njobs)
+    pipeline.nworkers = pipeline.njobs;
+  workers = malloc(pipeline.nworkers * sizeof(pthread_t));
+  pipeline.jobs = calloc(pipeline.njobs, sizeof(struct pipe_job));
+  pipeline.free = malloc(pipeline.njobs * sizeof(struct pipe_job *));
+  pipeline.ring = calloc(pipeline.njobs, sizeof(struct pipe_job *));
+  if (! workers || ! pipeline.jobs || ! pipeline.free || ! pipeline.ring ||
+      pipe_queue_init(&pipeline.fresh, pipeline.njobs + 1) ||
+      pipe_queue_init(&pipeline.work, pipeline.njobs + pipeline.nworkers) ||
+      pipe_queue_init(&pipeline.done, pipeline.njobs + pipeline.nworkers))
+    fatal_errcode(ssss_err_out_of_memory);
+  for(i = 0; i < pipeline.njobs; i++) {
+    pipeline.jobs[i].coeff = field_vec_xalloc(opt_threshold);
+    if (! (pipeline.jobs[i].out = malloc(pipeline.out_size)))
+      fatal_errcode(ssss_err_out_of_memory);
+    pipeline.free[i] = &pipeline.jobs[i];
+  }
+  pipeline.nfree = pipeline.njobs;
+
+  STATS_PHASE(STATS_EVALUATION);       /* the stages overlap */
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+  if (! pthread_create(&writer, &attr, pipe_writer, &wec)) {
+    started++;
+    for(w = 0; w < pipeline.nworkers; w++)
+      if (pthread_create(&workers[w], &attr, pipe_worker, NULL))
+        break;
+    if (w == pipeline.nworkers &&
+        ! pthread_create(&entropy, &attr, pipe_entropy, NULL))
+      started++;
+  }
+  pthread_attr_destroy(&attr);
+
+  if (started == 2)
+    ec = pipe_read();
+  else
+    ec = ssss_err_threads;
+  pipe_close_free();
+  if (started == 2)
+    pthread_join(entropy, NULL);
+  if (started) {
+    /* all workers have to see the end, even if not all of them started */
+    for(i = 0; i < pipeline.nworkers; i++)
+      pipe_push(&pipeline.work, &pipeline.end);
+    for(i = w; i < pipeline.nworkers; i++)
+      pipe_push(&pipeline.done, &pipeline.end);
+    for(i = 0; i < w; i++)
+      pthread_join(workers[i], NULL);
+    pthread_join(writer, NULL);
+  }
+  if (ec == ssss_ec_ok)
+    ec = wec;
+  if (ec == ssss_ec_ok)
+    ec = cprng_deinit();
+
+  for(i = 0; i < pipeline.njobs; i++) {
+    field_vec_free(pipeline.jobs[i].coeff, opt_threshold);
+    secure_zero(pipeline.jobs[i].out, pipeline.out_size);
+    free(pipeline.jobs[i].out);
+  }
+  pipe_queue_deinit(&pipeline.fresh);
+  pipe_queue_deinit(&pipeline.work);
+  pipe_queue_deinit(&pipeline.done);
+  free(pipeline.jobs);
+  free(pipeline.free);
+  free(pipeline.ring);
+  free(workers);
   field_deinit();
   return ec;
 }
 
+/* Self-test: compare the kernels the shares depend on against reference
+ * implementations on random data in every field, and combine share sets
+ * made by ssss 0.5.7. Any change to the arithmetic that makes existing
+ * shares unusable should show up here. */
+
+/* shares made by ssss-split 0.5.7 with diffusion layer and hex mode as
+   given; the first and the last threshold shares must give the secret, and
+   recovery the other shares */
+
+struct selftest_vector {
+  int threshold, hex, diffusion;
+  const char *secret;
+  const char *shares[16];
+};
+
+static const struct selftest_vector selftest_vectors[] = {
+  { 3, 0, 1,
+    "my secret root password",
+    { "1-0d4e72a2bc25a3e887235f0fa500c338be7d50b1aa1411",
+      "2-f88ef070f762cafdc37954e4ebbe1bfadcaab9f07d3089",
+      "3-e85a1d04ed7d2952d9cc3517f3017707a2ddb80d3159d0",
+      "4-c54495a3911662a28e5e4d358c4170ac78702d2dde9c5e",
+      "5-d59078d78b09810d94eb2cc694fe1c5106072cd092f515",
+      NULL } },
+  { 2, 1, 1,
+    "0123456789abcdef0123456789abcdef",
+    { "1-a909f6b276c688b3c569bfe5b335a124",
+      "2-ec1d7c0be0a0869e34f1e1b46f9d1454",
+      "3-d0eefa636d7d7c856479d47b24057886",
+      NULL } },
+  { 5, 1, 1,
+    "000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000"
+    "000000000000000000000000000000000000000000000000000000000000"
+    "00000000deadbeef",
+    { "1-c6a713822ff90052dda8046508bc2254b74654d9d3143ea1f0a625c39c"
+      "cdf0128f00369dc6c02a9f46fc42c39d9ac59c963e126f6f6b1bb9623396"
+      "edea7e0c5182c6590bdea9ef2c84941617e62f9cfa66fcc5627815ca9064"
+      "30a64edf0826773595eabe6c9a12d24a8e174ed5dccd0580da7dff1d3929"
+      "fd36551c1106b5e7b5",
+      "2-58e2fa2f3f82150514788599a696d94608ff77557da619650d637ad307"
+      "19baaccb4f72f6106ba47d89020131a2c64eb25bb89c2dfe7602a70d20ff"
+      "665975072fd12bc3d017fb4f94745c2c66240f281c8aeb6f5c9ffb54993e"
+      "72ae755e38be6ec07c0b003c9a883909c29d91d8c5facafd22afdd17a526"
+      "bf04ac8b839b1ce596",
+      "3-e724b7389691533cdf95cc70cff1df76e6be674c2c4d8de2ff28aebe05"
+      "7abd4fc22efb592515997aea039310122f203f3b6982e0573c16ce290cf0"
+      "57fd9583c4593cb9e2c5f134a886c6feebd6585b8cf68797f2f763ced8e3"
+      "78b01d3680a1f7aace003df93722a4e6a37c37a4320b5e0a6702217eb339"
+      "c11230560e226f736b",
+      "4-4390f8c93db1f709ade5cb5d668e0b14c7490b12b2360bc7a25895d5ab"
+      "f4ea70aa80f25c883925e8415d85f414b665f2042df65e38eb487e208e94"
+      "e9b983103a88d8f8f5844a13b1b8a56a5ab4df57baccce0935009977539f"
+      "592812ea316d0742456694d145baa651cd102e03b009791950cb76be7fff"
+      "1abc968ecbb25e2a6c",
+      "5-c6e0b8550c33e7af38ba594af0b567dd6d92660ac2895ea6e5c71f43d4"
+      "a606945aeac248d6bef79de0d1cf5643c9fdaafcf7edea1293ddd94f25b2"
+      "88366dce34a593767c12d3b1858b4465a5658a2e55f6915e837d990bf2f2"
+      "633f44bf3cdf3dd06b2e9571b982bba5c58a3336d7a2cddb50d4ec388eff"
+      "caee61a6e23be77fe9",
+      "6-2dc94aef2d6a5fc64c0f6f4ba027493d5b1fbf842e92faaf73aafda5b5"
+      "119a25ecb2f555d7e6a79aaa343da3b3b89b2f0167695b85ebc75bb73889"
+      "a3d37a7081bcc705d152a6a32cf97be530e1ae8e4d96e1aa8db146583ac8"
+      "41250345671c63d4ba4953eb1a3d50d05bf79aa8ee2142cc236203eddccf"
+      "d4544fda38c7dbfa52",
+      "7-cde865462fb588e470000ea3a46eebd13041ad9c3e5c34ef65c4de7b6e"
+      "25e3c039004d1247293a24903ae9ecc5f6495d7c087327f443bf081b7f17"
+      "b252fb06751dfe7766b36229763c3fc3048b2042dd6dd8a988a6c3b30d43"
+      "ab315c743b4cd463101a80879658164cf07e6285d42220dfe29b8effba10"
+      "e61c76b89d452259ca",
+      NULL } },
+  { 3, 0, 0,
+    "8bytes!!",
+    { "1-e05056146aa85257",
+      "2-3ed87b4d74cad769",
+      "3-e6ea542d7b11a419",
+      "4-ee6f0ee27e3c8f03",
+      NULL } },
+  { 2, 1, 1,
+    "a5",
+    { "1-64",
+      "2-3a",
+      "3-fb",
+      NULL } },
+  { 4, 0, 1,
+    "token secret",
+    { "tok-01-250d012d7951518cfda5d379d62306ca9efb5a2d0c034925c36e9"
+      "dc12a64443e",
+      "tok-02-72992ad3146d2e31124ba2f8636598634f5f8508b1cdd06986869"
+      "b3b3d33d0af",
+      "tok-03-650c0bab43008302c2cb14936f83afa961444bc6f2998422a4733"
+      "7b338225fae",
+      "tok-04-fb426634f984b98068ac0e7575758e38ac6f3380617feda5516e1"
+      "6a7fb62bc07",
+      "tok-05-ddccf7c2cbe68132ade4055e6a2cdd52cb4e8c532d1075c4bd603"
+      "6af7b7023ff",
+      "tok-06-e86fbd206cc5d58d699b0e5ff8148abb889eb14c8ea974dd657f2"
+      "9546621969c",
+      "tok-07-733f7ce292c807bfc64b3a6f8ca9785c41011ef61bce75047d8f5"
+      "0dcd133bb8e",
+      "tok-08-0d46ccf7b15b27f715750a55343d6720b23903723d53bd65f2a60"
+      "223187ea4ba",
+      "tok-09-63637f82be673640f84f76251dc263e6167519a19be0403d1f43c"
+      "5293e63dab5",
+      "tok-10-96b693900c66e7f2ba07e07f24a746a1df1b0956ab5b454bb16b5"
+      "9d4ad250dcc",
+      "tok-11-454d70d1cf351cc53da5a31466bce3ead5e903ecd4e021aba870c"
+      "75ebc38c129",
+      "tok-12-0ed6d791b17628529c6b98f309411afeaf8cae0e8855ba2b893b1"
+      "c403b45629b",
+      NULL } },
+  { 6, 1, 1,
+    "242160eacf27c3754216e431450b8aee0fd4e0f18a7b587d74b01d6e754a"
+    "22b57563853fb0172a2551b415f9d35f8a2a68b721ee67d045a75f2affbc"
+    "82d8d3fd",
+    { "1-db197a1f942f82bba748054d5d87f8b862d0443d3fa15b4ec19c3d01ce"
+      "0211cfe63b510f91e9c2da7db8736da113219e636bc500a3e38c8ec1f55f"
+      "769ae2392f",
+      "2-aa8a8a5480ad40cae99dbb63e8c756d2665c9cf956225f4406aed12dc6"
+      "2dcca1f8eaf83f08e4411c3eb91bf2dcf0a48cdea49dfdbf3a7c4a05ce43"
+      "d23847d22d",
+      "3-3afdcdbc48e28c0b4d42cadc032e66d52b460f9617d4a0dd365d5e5ae6"
+      "9104b7957045d74cfa40ce70b25eafb0f4c54ce7f3c1a1469fd36aab4e05"
+      "56cddceaba",
+      "4-871d3df027a9faf0fe7ac6015477638c4b13111ec87a6ae49366f6388b"
+      "f057bbe07830b4fe6f407928b5d054b9c4e875b5688026d17fc0c9bcac49"
+      "3bbc48f65e",
+      "5-0155295ee04422475b2597e7dec1f835bb27eaead13fae55dc672eb6e7"
+      "a23c0632de5b5b4212fd3282eee7cc53019b88f2752e883da69e3222978d"
+      "bcec099515",
+      "6-729cbec40dea305e2c88f5ce71682f4ff584053d4c18669f60102aa706"
+      "303c68c19555c4e46c913b21740e234ee4b7207a34e8130a42e172ed4aca"
+      "a043e49e65",
+      "7-fcd19ab4849f11795a29400a1e06ee6b31c27cf6e7fb227d67ba2f95b8"
+      "8de947c71a17ca5256f90a128ce56987e02df96c34a81b3aa5567100c9fc"
+      "ae85c49354",
+      "8-87f677ff2f434c86769eb95841dd51d31da8be1f006ada6704c93aed04"
+      "60dba5ae5ae309ae39c4c13abe193b05a37ce365b3d3fa772e73cff8ba7a"
+      "2394c2da03",
+      "9-f97cdab43d425144d4c75f96ff5c2fbaf7a0a33c46589525c00ec4aa23"
+      "41b259f2ec825265cea034af97cde252237b7ff753e5ec1888e9399b5b82"
+      "aa826c4b00",
+      NULL } }
+};
+
+int selftest_failures;
+
+void selftest_check(int ok, const char *what)
+{
+  if (! ok) {
+    fprintf(stderr, "Self-test: %s failed at %d bit security level.\n",
+            what, degree);
+    selftest_failures++;
+  }
+}
+
+/* field_mult() done differently: carry-less product, then reduction */
+
+void selftest_mult_ref(mpz_t z, const mpz_t x, const mpz_t y)
+{
+  mpz_t p, h;
+  int i;
+  mpz_init_set_ui(p, 0);
+  mpz_init(h);
+  for(i = 0; i < (int)degree; i++)
+    if (mpz_tstbit(y, i)) {
+      mpz_lshift(h, x, i);
+      mpz_xor(p, p, h);
+    }
+  for(i = 2 * degree - 2; i >= (int)degree; i--)
+    if (mpz_tstbit(p, i)) {
+      mpz_lshift(h, poly, i - degree);
+      mpz_xor(p, p, h);
+    }
+  mpz_swap(z, p);
+  mpz_clear(p);
+  mpz_clear(h);
+}
+
+/* the field laws over all pairs of the edge values 0, 1, x^(deg-1) and
+   all ones and of some random elements, with a third operand taken from
+   the same list */
+
+#define SELFTEST_RANDOM 4
+
+void selftest_field(void)
+{
+  mpz_t op[4 + SELFTEST_RANDOM], u, v, w;
+  int nop = sizeof(op) / sizeof(op[0]), i, j, ok;
+  mpz_t *a, *b, *c;
+  for(i = 0; i < nop; i++)
+    mpz_init(op[i]);
+  mpz_init(u); mpz_init(v); mpz_init(w);
+  mpz_set_ui(op[1], 1);
+  mpz_setbit(op[2], degree - 1);
+  mpz_setbit(op[3], degree);
+  mpz_sub_ui(op[3], op[3], 1);
+  for(ok = 1, i = 4; i < nop; i++)
+    ok = ok && cprng_read(op[i]) == ssss_ec_ok;
+  selftest_check(ok, "cprng_read");
+
+  for(i = 0; ok && i < nop; i++)
+    for(j = 0; j < nop; j++) {
+      a = &op[i];
+      b = &op[j];
+      c = &op[(i + j + 1) % nop];
+      field_mult(u, *a, *b);
+      selftest_mult_ref(v, *a, *b);
+      selftest_check(! mpz_cmp(u, v), "field_mult");
+      field_mult(v, *b, *a);
+      selftest_check(! mpz_cmp(u, v), "field_mult commutativity");
+      field_mult(v, u, *c);
+      field_mult(u, *b, *c);
+      field_mult(w, *a, u);
+      selftest_check(! mpz_cmp(v, w), "field_mult associativity");
+      field_add(u, *b, *c);
+      field_mult(v, *a, u);
+      field_mult(u, *a, *b);
+      field_mult(w, *a, *c);
+      field_add(u, u, w);
+      selftest_check(! mpz_cmp(u, v), "field_mult distributivity");
+    }
+
+  for(i = 0; ok && i < nop; i++) {
+    a = &op[i];
+    field_pow_ui(u, *a, 3);
+    field_mult(v, *a, *a);
+    field_mult(v, v, *a);
+    selftest_check(! mpz_cmp(u, v), "field_pow_ui");
+    field_mult(u, *a, op[0]);
+    selftest_check(! mpz_cmp_ui(u, 0), "field_mult by zero");
+
+    if (mpz_cmp_ui(*a, 0)) {
+      field_invert(u, *a);
+      field_mult(v, u, *a);
+      selftest_check(! mpz_cmp_ui(v, 1), "field_invert");
+      field_invert(v, u);
+      selftest_check(! mpz_cmp(v, *a), "field_invert involution");
+    }
+
+    if (degree >= 64) {
+      mpz_set(u, *a);
+      encode_mpz(u, ENCODE);
+      selftest_check(mpz_sizeinbits(u) <= degree, "encode_mpz range");
+      encode_mpz(u, DECODE);
+      selftest_check(! mpz_cmp(u, *a), "encode_mpz roundtrip");
+    }
+  }
+  for(i = 0; i < nop; i++)
+    mpz_clear(op[i]);
+  mpz_clear(u); mpz_clear(v); mpz_clear(w);
+}
+
+/* a random (t,n) scheme evaluated and solved every way there is */
+
+void selftest_scheme(int t, int n)
+{
+  mpz_t *coeff, *x, *y, *z, *w, *f, *A, *b, *b2, h;
+  unsigned long *points;
+  struct ptree *T;
+  int i, j, k, ok;
+  coeff = field_vec_xalloc(t);
+  x = field_vec_xalloc(n);
+  y = field_vec_xalloc(n);
+  z = field_vec_xalloc(n);
+  w = field_vec_xalloc(n);
+  f = field_vec_xalloc(t + 1);
+  A = field_vec_xalloc((size_t)t * t);
+  b = field_vec_xalloc(t);
+  b2 = field_vec_xalloc(t);
+  if (! (points = malloc(n * sizeof(unsigned long))))
+    fatal_errcode(ssss_err_out_of_memory);
+  mpz_init(h);
+
+  for(ok = 1, i = 0; i < t; i++)
+    ok = ok && cprng_read(coeff[i]) == ssss_ec_ok;
+  selftest_check(ok, "cprng_read");
+  for(i = 0; i < n; i++) {
+    points[i] = i + 1;
+    mpz_set_ui(x[i], i + 1);
+    horner_r(t, y[i], x[i], (const mpz_t *)coeff);
+  }
+
+  /* multipoint evaluation against Horner */
+  for(i = 0; i < t; i++)
+    mpz_set(f[i], coeff[t - 1 - i]);
+  mpz_set_ui(f[t], 1);
+  if ((ok = (T = ptree_build(points, n)) != NULL)) {
+    mpeval(z, T, (const mpz_t *)f, t + 1);
+    for(i = 0; i < n; i++)
+      ok = ok && ! mpz_cmp(z[i], y[i]);
+    ptree_free(T);
+  }
+  selftest_check(ok, "mpeval");
+
+  /* interpolation, with the x^t term removed */
+  for(i = 0; i < n; i++) {
+    field_pow_ui(h, x[i], t);
+    field_add(z[i], y[i], h);
+  }
+  selftest_check(! lagrange_secret(t, (const mpz_t *)x, (const mpz_t *)z, h) &&
+                 ! mpz_cmp(h, coeff[t - 1]), "lagrange_secret");
+  ok = ! lagrange_points(t, (const mpz_t *)x, (const mpz_t *)z, n,
+                         (const mpz_t *)x, w);
+  for(i = 0; i < n; i++)
+    ok = ok && ! mpz_cmp(w[i], z[i]);
+  selftest_check(ok, "lagrange_points");
+
+  /* the equation system of combine(), solved sequentially and in
+     parallel */
+  for(j = 0; j < 2; j++) {
+    for(i = 0; i < t; i++) {
+      mpz_set_ui(A[(size_t)(t - 1) * t + i], 1);
+      for(k = t - 2; k >= 0; k--)
+        field_mult(A[(size_t)k * t + i], A[(size_t)(k + 1) * t + i], x[i]);
+      field_mult(h, x[i], A[i]);
+      field_add(j ? b2[i] : b[i], y[i], h);
+    }
+    pool_task = ! j;
+    ok = restore_secret(t, (mpz_t (*)[t])A, j ? b2 : b, 1);
+    pool_task = 0;
+    selftest_check(! ok, "restore_secret");
+  }
+  for(ok = 1, i = 0; i < t; i++)
+    ok = ok && ! mpz_cmp(b[i], coeff[i]) && ! mpz_cmp(b2[i], coeff[i]);
+  selftest_check(ok, "restore_secret sequential and parallel");
+
+  mpz_clear(h);
+  free(points);
+  field_vec_free(coeff, t);
+  field_vec_free(x, n);
+  field_vec_free(y, n);
+  field_vec_free(z, n);
+  field_vec_free(w, n);
+  field_vec_free(f, t + 1);
+  field_vec_free(A, (size_t)t * t);
+  field_vec_free(b, t);
+  field_vec_free(b2, t);
+}
+
+/* combine the first and the last threshold shares of V, recover all */
+
+void selftest_vector(const struct selftest_vector *V)
+{
+  char buf[MAXLINELEN];
+  mpz_t *x, *y, *z, *out, h, secret;
+  unsigned s = 0;
+  int t = V->threshold, n, i, k, ok;
+  for(n = 0; V->shares[n]; n++);
+  x = field_vec_xalloc(n);
+  y = field_vec_xalloc(n);
+  z = field_vec_xalloc(n);
+  out = field_vec_xalloc(n);
+  mpz_init(h);
+  mpz_init(secret);
+  for(ok = 1, i = 0; i < n && ok; i++) {
+    strcpy(buf, V->shares[i]);
+    ok = parse_share(buf, x[i], y[i], &s) == ssss_ec_ok;
+  }
+  selftest_check(ok, "parsing 0.5.7 shares");
+  if (ok) {
+    for(i = 0; i < n; i++) {
+      field_pow_ui(h, x[i], t);
+      field_add(z[i], y[i], h);
+    }
+    selftest_check(field_import(secret, V->secret, V->hex) == ssss_ec_ok,
+                   "importing 0.5.7 secret");
+    for(k = 0; k < 2; k++) {
+      i = k ? n - t : 0;
+      ok = ! lagrange_secret(t, (const mpz_t *)x + i, (const mpz_t *)z + i, h);
+      if (V->diffusion && degree >= 64)
+        encode_mpz(h, DECODE);
+      selftest_check(ok && ! mpz_cmp(h, secret), "combining 0.5.7 shares");
+    }
+    ok = ! lagrange_points(t, (const mpz_t *)x, (const mpz_t *)z, n,
+                           (const mpz_t *)x, out);
+    for(i = 0; i < n; i++)
+      ok = ok && ! mpz_cmp(out[i], z[i]);
+    selftest_check(ok, "recovering 0.5.7 shares");
+  }
+  secure_zero(buf, sizeof(buf));
+  mpz_clear(h);
+  mpz_clear(secret);
+  field_vec_free(x, n);
+  field_vec_free(y, n);
+  field_vec_free(z, n);
+  field_vec_free(out, n);
+  if (degree)
+    field_deinit();
+}
+
+enum ssss_errcode selftest(void)
+{
+  enum ssss_errcode ec;
+  unsigned i;
+  int deg;
+  if ((ec = cprng_init()) != ssss_ec_ok)
+    return ec;
+  for(deg = 8; deg <= MAXDEGREE; deg += 8) {
+    field_init(deg);
+    selftest_field();
+    selftest_scheme(4, 9);
+    /* large enough for parallel elimination and Karatsuba in the tree */
+    if (deg == 64)
+      selftest_scheme(24, 40);
+    field_deinit();
+  }
+  for(i = 0; i < sizeof(selftest_vectors) / sizeof(selftest_vectors[0]); i++)
+    selftest_vector(&selftest_vectors[i]);
+  ec = cprng_deinit();
+  if (ec == ssss_ec_ok && ! opt_quiet)
+    fprintf(stderr, "Self-test %s: %d security levels, %u share sets "
+            "of version 0.5.7.\n", selftest_failures ? "failed" : "passed",
+            MAXDEGREE / 8, i);
+  if (ec == ssss_ec_ok && selftest_failures)
+    ec = ssss_err_selftest_failed;
+  return ec;
+}
+
 /* secure memory manipulation functions */
 
 void secure_zero(void *s, size_t n)
@@ -746,6 +3396,7 @@ void secure_free(void *ptr, size_t size)
 void * secure_realloc(void *ptr, size_t old_size, size_t new_size)
 {
   void *new_ptr = malloc(new_size);
+  STATS_COUNT(allocs);
   if (new_ptr)
     memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
   secure_zero(ptr, old_size);
@@ -753,10 +3404,45 @@ void * secure_realloc(void *ptr, size_t old_size, size_t new_size)
   return new_ptr;
 }
 
+#if ! NOMAIN
+
+/* parse a list of share indices like "1,4,7-9" into opt_index[] */
+
+int parse_indices(const char *s)
+{
+  unsigned long lo, hi, *p;
+  char *end;
+  for(;;) {
+    lo = hi = strtoul(s, &end, 10);
+    if (end == s)
+      return -1;
+    if (*end == '-') {
+      s = end + 1;
+      hi = strtoul(s, &end, 10);
+      if (end == s)
+        return -1;
+    }
+    if (! lo || lo > hi || hi > MAXSHARES ||
+        opt_nindex + (hi - lo + 1) > MAXSHARES)
+      return -1;
+    if (! (p = realloc(opt_index, (opt_nindex + (hi - lo + 1)) *
+                                  sizeof(unsigned long))))
+      return -1;
+    for(opt_index = p; lo <= hi; lo++)
+      opt_index[opt_nindex++] = lo;
+    if (! *end)
+      return 0;
+    if (*end != ',')
+      return -1;
+    s = end + 1;
+  }
+}
+
 int main(int argc, char *argv[])
 {
   enum ssss_errcode ec = ssss_ec_ok;
-  char *name;
+  char *name, *end;
+  long l;
   int i;
 
 #if ! NOMLOCK
@@ -790,15 +3476,27 @@ int main(int argc, char *argv[])
   echo_off = echo_orig;
   echo_off.c_lflag &= ~ECHO;
 
+  STATS_PHASE(STATS_OTHER);
+
   opt_help = argc == 1;
+  const struct option long_flags[] = {
+#if ! NOSTATS
+    { "stats", optional_argument, NULL, 'S' },
+#endif
+    { "refresh", no_argument, NULL, 'R' },
+    { "batch", no_argument, NULL, 'B' },
+    { "audit", no_argument, NULL, 'A' },
+    { "selftest", no_argument, NULL, 'T' },
+    { NULL, 0, NULL, 0 }
+  };
   const char* flags =
 #if ! NOMLOCK
-    "MvDhqQxrs:t:n:w:";
+    "MvDhqQxrs:t:n:w:j:i:k:";
 #else
-    "vDhqQxrs:t:n:w:";
+    "vDhqQxrs:t:n:w:j:i:k:";
 #endif
 
-  while((i = getopt(argc, argv, flags)) != -1)
+  while((i = getopt_long(argc, argv, flags, long_flags, NULL)) != -1)
     switch(i) {
     case 'v': opt_showversion = 1; break;
     case 'h': opt_help = 1; break;
@@ -811,11 +3509,36 @@ int main(int argc, char *argv[])
     case 'w': opt_token = optarg; break;
     case 'D': opt_diffusion = 0; break;
     case 'r': opt_recovery = 1; break;
+    case 'j':
+      l = strtol(optarg, &end, 10);
+      if (end == optarg || *end || l < 1 || l > MAXTHREADS)
+        fatal("invalid parameters: invalid number of threads");
+      opt_threads = l;
+      break;
+    case 'k': opt_packed = atoi(optarg); break;
+    case 'R': opt_refresh = 1; break;
+    case 'B': opt_batch = 1; break;
+    case 'A': opt_audit = 1; break;
+    case 'T': opt_selftest = 1; break;
+    case 'i':
+      if (parse_indices(optarg))
+        fatal("invalid parameters: invalid list of share indices");
+      break;
 #if ! NOMLOCK
     case 'M':
       if(failedMemoryLock != 0)
         fatal("memory lock is required to proceed");
       break;
+#endif
+#if ! NOSTATS
+    case 'S':
+      if (! optarg || ! strcmp(optarg, "text"))
+        opt_stats = 1;
+      else if (! strcmp(optarg, "json"))
+        opt_stats = 2;
+      else
+        fatal("invalid parameters: invalid statistics format");
+      break;
 #endif
     default:
       exit(1);
@@ -826,7 +3549,13 @@ int main(int argc, char *argv[])
   if ((name = strrchr(argv[0], '/')) == NULL)
     name = argv[0];
 
-  if (strstr(name, "split")) {
+  if (opt_selftest && ! opt_help && ! opt_showversion) {
+    /* with a worker thread at least, so that the parallel kernels are
+       compared with the sequential ones even on a single CPU */
+    pool_init(opt_threads > 0 ? opt_threads : 2);
+    ec = selftest();
+  }
+  else if (strstr(name, "split")) {
     if (opt_help || opt_showversion) {
       fputs("Split secrets using Shamir's Secret Sharing Scheme.\n"
             "\n"
@@ -834,28 +3563,64 @@ int main(int argc, char *argv[])
 #if ! NOMLOCK
             " [-M]"
 #endif
-            " [-r] [-x] [-q] [-Q] [-D] [-v]\n",
+            " [-r [-i indices] | -k secrets | --batch] [-j threads] [-x] [-q]"
+            " [-Q] [-D] [-v]"
+#if ! NOSTATS
+            " [--stats[=json]]"
+#endif
+            "\n"
+            "ssss-split --selftest [-j threads] [-q]\n",
             stderr);
       if (opt_showversion)
         fputs("\nVersion: " VERSION, stderr);
       exit(0);
     }
 
-    if (opt_threshold < 2)
+    if (opt_refresh)
+      fatal("invalid parameters: --refresh is an option of ssss-combine");
+
+    if (opt_audit)
+      fatal("invalid parameters: --audit is an option of ssss-combine");
+
+    if (opt_threshold < 2 || opt_threshold > MAXSHARES)
       fatal("invalid parameters: invalid threshold value");
 
-    if (opt_number < opt_threshold)
+    if (opt_packed < 1 || opt_packed > MAXSHARES - opt_threshold + 1)
+      fatal("invalid parameters: invalid number of packed secrets");
+
+    if (opt_packed > 1 && opt_recovery)
+      fatal("invalid parameters: packed secrets can't be recovered");
+
+    if (opt_number < opt_threshold + opt_packed - 1)
       fatal("invalid parameters: number of shares smaller than threshold");
 
+    if (opt_number > MAXSHARES)
+      fatal("invalid parameters: number of shares too large");
+
     if (opt_security && ! field_size_valid(opt_security))
       fatal("invalid parameters: invalid security level");
 
     if (opt_token && (strlen(opt_token) > MAXTOKENLEN))
       fatal("invalid parameters: token too long");
 
+    if (opt_index && ! opt_recovery)
+      fatal("invalid parameters: share indices require recovery mode");
+
+    for(i = 0; i < opt_nindex; i++)
+      if (opt_index[i] > (unsigned long)opt_number)
+        fatal("invalid parameters: share index larger than number of shares");
+
+    if (opt_batch && (opt_recovery || opt_packed > 1))
+      fatal("invalid parameters: --batch can't be combined with -r or -k");
+
+    if (opt_batch && ! opt_security)
+      fatal("invalid parameters: --batch requires a security level");
+
     /* Splitting in recovery mode is the same as combining, where one share
      * is the secret itself. */
-    ec = (opt_recovery ? combine(1) : split());
+    pool_init(opt_threads);
+    ec = (opt_batch ? split_batch() : opt_recovery ? combine(1) :
+          opt_packed > 1 ? split_packed() : split());
   }
   else {
     if (opt_help || opt_showversion) {
@@ -865,19 +3630,63 @@ int main(int argc, char *argv[])
 #if ! NOMLOCK
             " [-M]"
 #endif
-            " [-r -n shares] [-x] [-q] [-Q] [-D] [-v]\n",
+            " [-r -n shares [-i indices] | -k secrets | --refresh | --audit]"
+            " [-j threads] [-x] [-q] [-Q] [-D] [-v]"
+#if ! NOSTATS
+            " [--stats[=json]]"
+#endif
+            "\n"
+            "ssss-combine --selftest [-j threads] [-q]\n",
             stderr);
       if (opt_showversion)
         fputs("\nVersion: " VERSION, stderr);
       exit(0);
     }
 
-    if (opt_threshold < 2)
+    if (opt_batch)
+      fatal("invalid parameters: --batch is an option of ssss-split");
+
+    if (opt_threshold < 2 || opt_threshold > MAXSHARES)
       fatal("invalid parameters: invalid threshold value");
 
-    ec = combine(0);
+    if (opt_recovery && (opt_number < 1 || opt_number > MAXSHARES))
+      fatal("invalid parameters: invalid number of shares");
+
+    if (opt_packed < 1 || opt_packed > MAXSHARES - opt_threshold + 1)
+      fatal("invalid parameters: invalid number of packed secrets");
+
+    if (opt_packed > 1 && opt_recovery)
+      fatal("invalid parameters: packed secrets can't be recovered");
+
+    if (opt_index && ! opt_recovery)
+      fatal("invalid parameters: share indices require recovery mode");
+
+    for(i = 0; i < opt_nindex; i++)
+      if (opt_index[i] > (unsigned long)opt_number)
+        fatal("invalid parameters: share index larger than number of shares");
+
+    if (opt_refresh && (opt_recovery || opt_packed > 1))
+      fatal("invalid parameters: shares can't be refreshed with -r or -k");
+
+    if (opt_audit && (opt_recovery || opt_packed > 1 || opt_refresh))
+      fatal("invalid parameters: --audit can't be combined with -r, -k or "
+            "--refresh");
+
+    pool_init(opt_threads);
+    ec = (opt_audit ? audit() : opt_refresh ? refresh() :
+          opt_recovery ? combine(0) :
+          opt_packed > 1 ? combine_packed() : combine_secret());
   }
+  pool_deinit();
+#if ! NOSTATS
+  /* a failed audit or self-test did all its work, so report it too */
+  if (opt_stats && (ec == ssss_ec_ok || ec == ssss_err_audit_failed ||
+                    ec == ssss_err_selftest_failed))
+    stats_report(stderr, opt_stats == 2);
+#endif
   if (ec != ssss_ec_ok)
     fatal_errcode(ec);
   return 0;
 }
+
+#endif